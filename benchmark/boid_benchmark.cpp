@@ -0,0 +1,202 @@
+// Headless benchmark of the fish simulation: no window, no OpenGL context and no asset is needed.
+//
+// For every fish count, the domain grows along x and y so that schools keep the density of the scene,
+// then the boid step is timed with an increasing number of threads. Results are printed as JSON.
+//
+// Usage: boid_benchmark [--ticks N] [--min-fish N] [--max-fish N] [--max-threads N]
+
+#include "living_entities.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace cgp;
+
+struct benchmark_parameters
+{
+	int ticks = 10;            // Timed ticks per run, after warmup_ticks untimed ones
+	int warmup_ticks = 2;
+	int min_fish = 1000;
+	int max_fish = 1000000;
+	int max_threads = 0;       // 0 uses every hardware thread
+	int neighbor_samples = 4096; // Fishes used to measure the neighbor counts
+};
+
+struct thread_result
+{
+	int threads;
+	double grid_ms;            // Rebuild of the neighbor grid alone
+	double tick_ms;            // Whole tick, grid included
+	double ns_per_fish_step;
+};
+
+struct neighbor_statistics
+{
+	double candidates; // Fishes inside the buckets of the 27 visited cells
+	double neighbors;  // Fishes closer than fish_radius
+};
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+/// <summary>
+/// Spawns fish_number fishes by schools of fishes_per_group, as the scene does, in a domain scaled along x and y
+/// so that the number of schools per unit of area stays the same as with the default settings.
+/// </summary>
+static void setup_population(fish_manager& manager, int fish_number)
+{
+	environment_structure environment;
+	fish_manager reference;
+	float const reference_fishes = float(reference.fish_groups_number * reference.fishes_per_group);
+	float const area_scale = std::sqrt(std::max(1.0f, fish_number / reference_fishes));
+
+	vec3 const domain = { environment.domain.length.x * area_scale, environment.domain.length.y * area_scale, environment.domain.length.z };
+	manager.initialize_domain(domain, environment.ground_level);
+	manager.school_lod_distance = std::numeric_limits<float>::infinity(); // Measures the per-fish boids, no school is aggregated
+
+	std::mt19937 generator(42);
+	std::uniform_real_distribution<float> distrib(-0.5f, 0.5f);
+	manager.fishes.clear();
+	while (manager.fishes.size() < fish_number) {
+		int const fish_type = manager.fishes.size() / manager.fishes_per_group % 5;
+		vec3 const group_dir = 2 * vec3(distrib(generator), distrib(generator), distrib(generator));
+		vec3 const group_pos = { domain.x * distrib(generator), domain.y * distrib(generator), environment.ground_level * .5f };
+		for (int j = 0; j < manager.fishes_per_group && manager.fishes.size() < fish_number; j++) {
+			vec3 const position = group_pos + 50.0f * vec3(distrib(generator), distrib(generator), distrib(generator));
+			manager.fishes.add(position, group_dir, manager.fish_speed, 12.0f, fish_type, manager.fishes.size() / manager.fishes_per_group);
+		}
+	}
+}
+
+static neighbor_statistics measure_neighbors(fish_manager& manager, int samples)
+{
+	manager.refresh_grid();
+
+	neighbor_statistics statistics = { 0, 0 };
+	int const fish_number = manager.fishes.size();
+	int const step = std::max(1, fish_number / samples);
+	int count = 0;
+	for (int i = 0; i < fish_number; i += step, count++) {
+		int2 ranges[18];
+		int const range_number = manager.get_neighbor_ranges(manager.get_cell(manager.fishes.position[i]), ranges);
+		for (int r = 0; r < range_number; r++)
+			statistics.candidates += ranges[r].y - ranges[r].x;
+
+		statistics.neighbors += manager.accumulate_neighbors(i, manager.fishes.direction[i]).separation_count;
+	}
+
+	statistics.candidates /= count;
+	statistics.neighbors /= count;
+	return statistics;
+}
+
+static thread_result run(int fish_number, int threads, benchmark_parameters const& parameters)
+{
+	// Obstacles are left empty: avoidance is skipped and only the boid step is measured
+	implicit_surface_field_structure obstacles;
+	float const dt = 1.0f / 60.0f;
+
+	thread_pool workers;
+	workers.initialize(threads - 1);
+
+	fish_manager manager;
+	manager.workers = &workers;
+	setup_population(manager, fish_number);
+
+	for (int t = 0; t < parameters.warmup_ticks; t++)
+		manager.refresh(obstacles, dt);
+
+	thread_result result = { threads, 0, 0, 0 };
+	for (int t = 0; t < parameters.ticks; t++) {
+		auto start = std::chrono::steady_clock::now();
+		manager.refresh_grid();
+		result.grid_ms += elapsed_ms(start);
+
+		start = std::chrono::steady_clock::now();
+		manager.refresh(obstacles, dt);
+		result.tick_ms += elapsed_ms(start);
+	}
+
+	result.grid_ms /= parameters.ticks;
+	result.tick_ms /= parameters.ticks;
+	result.ns_per_fish_step = 1e6 * result.tick_ms / fish_number;
+	return result;
+}
+
+static benchmark_parameters parse_arguments(int argc, char** argv)
+{
+	benchmark_parameters parameters;
+	for (int k = 1; k + 1 < argc; k += 2) {
+		int const value = std::max(1, std::atoi(argv[k + 1]));
+		if (std::strcmp(argv[k], "--ticks") == 0)
+			parameters.ticks = value;
+		else if (std::strcmp(argv[k], "--min-fish") == 0)
+			parameters.min_fish = value;
+		else if (std::strcmp(argv[k], "--max-fish") == 0)
+			parameters.max_fish = value;
+		else if (std::strcmp(argv[k], "--max-threads") == 0)
+			parameters.max_threads = value;
+		else
+			std::fprintf(stderr, "Unknown option %s\n", argv[k]);
+	}
+	return parameters;
+}
+
+int main(int argc, char** argv)
+{
+	benchmark_parameters const parameters = parse_arguments(argc, argv);
+
+	int const hardware_threads = std::max(1, (int)std::thread::hardware_concurrency());
+	int const max_threads = parameters.max_threads > 0 ? parameters.max_threads : hardware_threads;
+
+	// 1, 2, 4, ... threads, and the maximum
+	std::vector<int> thread_counts;
+	for (int t = 1; t < max_threads; t *= 2)
+		thread_counts.push_back(t);
+	thread_counts.push_back(max_threads);
+
+	std::printf("{\n");
+	std::printf("  \"hardware_threads\": %d,\n", hardware_threads);
+	std::printf("  \"avx2\": %s,\n", cpu_has_avx2() ? "true" : "false");
+	std::printf("  \"ticks\": %d,\n", parameters.ticks);
+	std::printf("  \"runs\": [");
+
+	bool first_run = true;
+	for (int fish_number = parameters.min_fish; fish_number <= parameters.max_fish; fish_number *= 10)
+	{
+		fish_manager manager;
+		setup_population(manager, fish_number);
+		neighbor_statistics const statistics = measure_neighbors(manager, parameters.neighbor_samples);
+
+		std::printf("%s\n    {\n", first_run ? "" : ",");
+		std::printf("      \"fish\": %d,\n", fish_number);
+		std::printf("      \"domain\": [%.1f, %.1f, %.1f],\n", manager.domain_x, manager.domain_y, manager.domain_z);
+		std::printf("      \"hash_buckets\": %d,\n", manager.bucket_number);
+		std::printf("      \"candidates_per_fish\": %.2f,\n", statistics.candidates);
+		std::printf("      \"neighbors_per_fish\": %.2f,\n", statistics.neighbors);
+		std::printf("      \"threads\": [");
+		first_run = false;
+
+		double single_thread_ms = 0;
+		for (size_t k = 0; k < thread_counts.size(); k++) {
+			thread_result const result = run(fish_number, thread_counts[k], parameters);
+			if (k == 0)
+				single_thread_ms = result.tick_ms;
+
+			std::printf("%s\n        { \"threads\": %d, \"grid_ms\": %.4f, \"tick_ms\": %.4f, \"ns_per_fish_step\": %.2f, \"speedup\": %.2f }",
+				k == 0 ? "" : ",", result.threads, result.grid_ms, result.tick_ms, result.ns_per_fish_step, single_thread_ms / result.tick_ms);
+			std::fflush(stdout);
+		}
+		std::printf("\n      ]\n    }");
+	}
+	std::printf("\n  ]\n}\n");
+
+	return 0;
+}
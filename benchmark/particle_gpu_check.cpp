@@ -0,0 +1,208 @@
+// Headless check of the GPU particle simulation against the CPU integrator, in an offscreen OpenGL 3.3 context.
+//
+// The same particles are spawned on both sides every step: the CPU integrates them with integrate_particles_scalar
+// and removes the dead ones, the GPU runs gpu_particle_system::step. At the end, the live counts of every type must
+// be equal and the positions must match within a tolerance. Results are printed as JSON, the exit code is 1 on failure.
+//
+// The context is created with EGL without any surface (EGL_MESA_platform_surfaceless), so it also runs on machines
+// without a display, e.g. with the llvmpipe software rasterizer: LIBGL_ALWAYS_SOFTWARE=1 particle_gpu_check
+//
+// Usage: particle_gpu_check [--steps N] [--spawn N] [--seed N] [--tolerance X]
+
+#include "particles.hpp"
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace cgp;
+
+struct check_parameters
+{
+	int steps = 240;          // Steps of 1/60 s
+	int spawn = 200;          // Particles spawned per step, alternating between the types
+	int seed = 5;
+	float tolerance = 1e-3f;  // Maximum distance between the CPU and the GPU positions
+};
+
+/// <summary>
+/// Makes an OpenGL 3.3 core context current without any window nor surface, and loads the OpenGL functions.
+/// Drawing goes to a small framebuffer object, since there is no default framebuffer.
+/// </summary>
+static bool create_offscreen_context()
+{
+	auto const get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (get_platform_display == nullptr)
+		return false;
+	EGLDisplay const display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, nullptr, nullptr))
+		return false;
+	eglBindAPI(EGL_OPENGL_API);
+
+	EGLint const config_attributes[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+	EGLConfig config = nullptr;
+	EGLint config_number = 0;
+	eglChooseConfig(display, config_attributes, &config, 1, &config_number);
+
+	EGLint const context_attributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 3, EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE };
+	EGLContext const context = eglCreateContext(display, config_number > 0 ? config : nullptr, EGL_NO_CONTEXT, context_attributes);
+	if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		return false;
+	if (!gladLoadGLLoader((GLADloadproc)eglGetProcAddress))
+		return false;
+
+	GLuint framebuffer = 0, renderbuffer = 0;
+	glGenFramebuffers(1, &framebuffer);
+	glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+	glGenRenderbuffers(1, &renderbuffer);
+	glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+	glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, 64, 64);
+	glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffer);
+	return true;
+}
+
+/// Removes the dead particles of storage, keeping the order of the survivors like particle_manager::tick
+static void remove_dead_particles(particle_storage& storage)
+{
+	int survivors = 0;
+	for (int i = 0; i < storage.size(); i++) {
+		if (storage.time_lived[i] > storage.lifetime[i])
+			continue;
+		if (i != survivors)
+			storage.move(i, survivors);
+		survivors++;
+	}
+	storage.resize(survivors);
+}
+
+static check_parameters parse_arguments(int argc, char** argv)
+{
+	check_parameters parameters;
+	for (int k = 1; k + 1 < argc; k += 2) {
+		if (std::strcmp(argv[k], "--steps") == 0)
+			parameters.steps = std::max(1, std::atoi(argv[k + 1]));
+		else if (std::strcmp(argv[k], "--spawn") == 0)
+			parameters.spawn = std::max(0, std::atoi(argv[k + 1]));
+		else if (std::strcmp(argv[k], "--seed") == 0)
+			parameters.seed = std::atoi(argv[k + 1]);
+		else if (std::strcmp(argv[k], "--tolerance") == 0)
+			parameters.tolerance = float(std::atof(argv[k + 1]));
+		else
+			std::fprintf(stderr, "Unknown option %s\n", argv[k]);
+	}
+	return parameters;
+}
+
+int main(int argc, char** argv)
+{
+	check_parameters const parameters = parse_arguments(argc, argv);
+	std::string const project_path = cgp::project_path_find(argv[0], "shaders/");
+
+	if (!create_offscreen_context()) {
+		std::fprintf(stderr, "Cannot create an offscreen OpenGL 3.3 context with EGL\n");
+		return 1;
+	}
+
+	// The particle types of the scene, without their textures
+	particle_manager manager;
+	manager.last_time = 0;
+	manager.z_limit = -30.0f;
+	manager.gravity = { 0.0f, 0.0f, -9.81f };
+	mesh const quadrangle = mesh_primitive_quadrangle({ -0.5f,0,0 }, { 0.5f,0,0 }, { 0.5f,0,1 }, { -0.5f,0,1 });
+	mesh_drawable bubble, dot;
+	bubble.initialize_data_on_gpu(quadrangle);
+	dot.initialize_data_on_gpu(quadrangle);
+	manager.particle_types.push_back(particle_type(bubble, 1.0f, -1.0f, 1.0f, .1f * vec3(2.0f, 2.0f, 1.0f), .1f));
+	manager.particle_types.push_back(particle_type(dot, .3f, -1.0f, 0.0f, vec3(0, 0, 1), 0.0f));
+	manager.update_type_coefficients();
+	manager.gpu_capacity = parameters.steps * parameters.spawn;
+	manager.feedback_shader = load_particle_feedback_shader(
+		project_path + "shaders/particle_feedback/vert.glsl",
+		project_path + "shaders/particle_feedback/geom.glsl");
+	manager.set_gpu_simulation(true);
+
+	// Particles start below z_limit and rise: some die of age, others one second after crossing z_limit
+	std::mt19937 generator(parameters.seed);
+	std::uniform_real_distribution<float> distrib(-1.0f, 1.0f);
+	particle_storage cpu;
+	float const dt = 1.0f / 60.0f;
+	for (int s = 0; s < parameters.steps; s++)
+	{
+		for (int k = 0; k < parameters.spawn; k++) {
+			int const type = k % 2;
+			particle const spawned(
+				{ 50 * distrib(generator), 50 * distrib(generator), manager.z_limit - 30 + 20 * distrib(generator) },
+				10.0f * vec3(distrib(generator), distrib(generator), distrib(generator)),
+				distrib(generator), 10 * distrib(generator), 2.5f + distrib(generator), 1 + .3f * distrib(generator));
+			cpu.push_back(spawned, type);
+			manager.register_particle(spawned, type);
+		}
+
+		integrate_particles_scalar(cpu, manager, 0, cpu.size(), dt);
+		remove_dead_particles(cpu);
+
+		// Waiting for every pass makes the GPU integrate with the same steps as the CPU
+		for (int k = 0; k < (int)manager.gpu_systems.size(); k++) {
+			gpu_particle_system& system = manager.gpu_systems[k];
+			vec3 const acceleration = { manager.acceleration_x[k], manager.acceleration_y[k], manager.acceleration_z[k] };
+			vec3 const damping = { manager.damping_x[k], manager.damping_y[k], manager.damping_z[k] };
+			system.synchronize();
+			system.step(manager.feedback_shader, dt, manager.z_limit, acceleration, damping, manager.rot_damping[k]);
+		}
+	}
+
+	// The GPU keeps the particles of each type in their spawn order, as the CPU storage does for all the types
+	int const type_number = manager.gpu_systems.size();
+	std::vector<std::vector<gpu_particle_system::state>> states(type_number);
+	std::vector<int> cpu_count(type_number, 0), gpu_count(type_number, 0);
+	for (int k = 0; k < type_number; k++) {
+		gpu_particle_system& system = manager.gpu_systems[k];
+		system.synchronize();
+		gpu_count[k] = system.count;
+		states[k].resize(system.count);
+		glBindBuffer(GL_ARRAY_BUFFER, system.buffer[system.current]);
+		glGetBufferSubData(GL_ARRAY_BUFFER, 0, GLsizeiptr(system.count * sizeof(gpu_particle_system::state)), states[k].data());
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	for (int i = 0; i < cpu.size(); i++)
+		cpu_count[cpu.type[i]]++;
+
+	bool counts_match = cpu_count == gpu_count;
+	float max_error = 0;
+	if (counts_match) {
+		std::vector<int> next(type_number, 0);
+		for (int i = 0; i < cpu.size(); i++) {
+			gpu_particle_system::state const& state = states[cpu.type[i]][next[cpu.type[i]]++];
+			vec3 const gpu_position = { state.position_scale.x, state.position_scale.y, state.position_scale.z };
+			max_error = std::max(max_error, norm(cpu.position(i) - gpu_position));
+		}
+	}
+	GLenum const gl_error = glGetError();
+	bool const pass = counts_match && max_error <= parameters.tolerance && gl_error == GL_NO_ERROR;
+
+	std::printf("{\n");
+	std::printf("  \"renderer\": \"%s\",\n", reinterpret_cast<char const*>(glGetString(GL_RENDERER)));
+	std::printf("  \"steps\": %d,\n", parameters.steps);
+	std::printf("  \"types\": [");
+	for (int k = 0; k < type_number; k++)
+		std::printf("%s\n    { \"cpu_live\": %d, \"gpu_live\": %d }", k == 0 ? "" : ",", cpu_count[k], gpu_count[k]);
+	std::printf("\n  ],\n");
+	std::printf("  \"max_position_error\": %g,\n", counts_match ? max_error : -1.0f);
+	std::printf("  \"tolerance\": %g,\n", parameters.tolerance);
+	std::printf("  \"gl_error\": %u,\n", gl_error);
+	std::printf("  \"pass\": %s\n", pass ? "true" : "false");
+	std::printf("}\n");
+
+	manager.set_gpu_simulation(false);
+	return pass ? 0 : 1;
+}
@@ -0,0 +1,36 @@
+#include "cpu.hpp"
+
+#if defined(CGP_SIMD_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace cgp
+{
+	static bool detect_avx2()
+	{
+#if !defined(CGP_SIMD_X86)
+		return false;
+#elif defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 1);
+		bool const osxsave = (info[2] & (1 << 27)) != 0;
+		bool const fma = (info[2] & (1 << 12)) != 0;
+		if (!osxsave || !fma)
+			return false;
+		// The OS must save the YMM registers
+		if ((_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+	}
+
+	bool cpu_has_avx2()
+	{
+		static bool const avx2 = detect_avx2();
+		return avx2;
+	}
+}
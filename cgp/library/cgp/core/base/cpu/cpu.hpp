@@ -0,0 +1,21 @@
+#pragma once
+
+// SIMD helpers
+//  - CGP_SIMD_X86 is defined when compiling for x86/x86-64, where SSE/AVX intrinsics are available
+//  - CGP_TARGET_AVX2 marks a function allowed to use AVX2/FMA intrinsics even if the rest of the code is compiled without -mavx2.
+//    Such function must only be called after checking cpu_has_avx2() at runtime.
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CGP_SIMD_X86
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define CGP_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define CGP_TARGET_AVX2
+#endif
+
+namespace cgp
+{
+	/** Return true if the processor and the OS support AVX2 and FMA instructions (checked once). */
+	bool cpu_has_avx2();
+}
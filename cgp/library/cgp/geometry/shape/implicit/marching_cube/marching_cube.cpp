@@ -2,16 +2,11 @@
 
 #include "cgp/geometry/interpolation/interpolation.hpp"
 #include "helper/marching_cubes_lut.hpp"
-#include <unordered_map>
+#include <algorithm>
 
 namespace cgp
 {
 
-	// Helper structure to hash a pair of index (a,b) as a unique number
-	struct hash_edge {
-		size_t operator()(std::pair<int, int> const& key) const;
-	};
-
 	// Helper structure to store voxels information
 	struct cube_parameters {
 		std::array<size_t, 8> index;
@@ -24,60 +19,19 @@ namespace cgp
 	{
 		assert_cgp_no_msg(is_equal(field.dimension, domain.samples));
 
-		// Compute the marching cube
+		// Compute the marching cube, the vertices on the same edge of the grid being shared
 		std::vector<vec3> position;
-		std::vector<marching_cube_relative_coordinates> relative;
-		int const N = marching_cube(position, field.data.data, domain, iso, &relative);
-
+		std::vector<uint3> connectivity;
+		marching_cube_indexed(position, connectivity, field.data.data, domain, iso);
 
-		// Compute the mesh with non-duplicated vertices
 		mesh m;
-		int const N_triangle = N / 3;
-
-		// Storage avoiding to duplicate vertices at the same position if they are on the same voxel edge
-		std::unordered_map<std::pair<int, int>, int, hash_edge> unique_edge;
-
-		for (int k_tri = 0; k_tri < N_triangle; ++k_tri) {
-
-			uint3 triangle_index;
-			for (int k = 0; k < 3; ++k) {
-
-				int const idx = 3 * k_tri + k;
-
-				// The indices of the edge of the current vertex
-				std::pair<int, int> const edge = { relative[3 * k_tri+k].k0, relative[3 * k_tri+k].k1 };
-
-				// Check if this edge has already been encountered
-				auto const it = unique_edge.find(edge);
-
-				// if it is a new edge, add this vertex as a new one in the mesh
-				if (it == unique_edge.end()) {
-					int const idx_new_vertex = m.position.size(); // create a new vertex index
-					triangle_index[k] = idx_new_vertex; // set the current index to the triangle connectivity
-					m.position.push_back(position[idx]); // add this vertex in the mesh
-					unique_edge[edge] = idx_new_vertex; // add the edge in the unique structure for further check
-				}
-				// if the edge has already been encountered - only reuse the index in the connectivity but do not add the vertex again
-				else {
-					int const idx_existing_vertex = it->second;   // the index that has already be defined
-					triangle_index[k] = idx_existing_vertex;      // set this existing index in the triangle connectivity
-				}
-			}
-			m.connectivity.push_back(triangle_index); // add the new triangle
-			
-			
-		}
-
+		m.position.data = std::move(position);
+		m.connectivity.data = std::move(connectivity);
 		m.fill_empty_field();
 		return m;
 	}
 
 
-	size_t hash_edge::operator()(std::pair<int, int> const& key) const {
-		return std::hash<int>{}(key.first) ^ std::hash<int>{}(key.second);
-	}
-
-
 	void fill_position(vec3& cube_position, float ux, float uy, float uz, vec3 const& domain_min, vec3 const& domain_length)
 	{
 		cube_position.x = domain_min.x + ux * domain_length.x;
@@ -102,13 +56,45 @@ namespace cgp
 
 
 
-	size_t marching_cube(std::vector<vec3>& position, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative)
-	{
+	// Lookup tables shared by every call (initialized once, thread-safe)
+	struct marching_cube_tables {
 		// Table of correspondance between the 256 type of cube and the edges on which new vertices are created
-		static std::array<std::array<int, 16>, 256> const triTable = marching_cube_lut_triTable();
+		std::array<std::array<int, 16>, 256> triTable;
 		// Storage of the order of edge visiting on the cube
-		static std::array<std::pair<int, int>, 12> const lut_edge_order = marching_cube_lut_edge_order();
-		static std::array<int, 256> const edgeTable = marching_cube_lut_edgeTable();
+		std::array<std::pair<int, int>, 12> edge_order;
+		std::array<int, 256> edgeTable;
+		// Number of vertices of the triangles created by each type of cube
+		std::array<int, 256> vertex_count;
+
+		marching_cube_tables()
+		{
+			triTable = marching_cube_lut_triTable();
+			edge_order = marching_cube_lut_edge_order();
+			edgeTable = marching_cube_lut_edgeTable();
+			for (int type = 0; type < 256; ++type) {
+				int k = 0;
+				while (k < 16 && triTable[type][k] != -1)
+					++k;
+				vertex_count[type] = k;
+			}
+		}
+	};
+
+	static marching_cube_tables const& get_marching_cube_tables()
+	{
+		static marching_cube_tables const tables;
+		return tables;
+	}
+
+	// Marching cube over the layers of cubes [kz_begin, kz_end).
+	// When position is null, only the number of vertices is computed (no interpolation). Otherwise the triangles are written from position (and relative if not null).
+	// Returns the number of vertices of the layers.
+	static size_t marching_cube_slab(std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, size_t kz_begin, size_t kz_end, vec3* position, marching_cube_relative_coordinates* relative)
+	{
+		marching_cube_tables const& tables = get_marching_cube_tables();
+		std::array<std::array<int, 16>, 256> const& triTable = tables.triTable;
+		std::array<std::pair<int, int>, 12> const& lut_edge_order = tables.edge_order;
+		std::array<int, 256> const& edgeTable = tables.edgeTable;
 
 		vec3 const domain_min = domain.center - domain.length / 2.0;
 		vec3 const& domain_length = domain.length;
@@ -131,9 +117,7 @@ namespace cgp
 
 		std::array<size_t, 8> const offset_cube = { 0, 1, 1+Nx, Nx, Nx*Ny, 1+Nx*Ny, 1+Nx+Nx*Ny, Nx+Nx*Ny };
 
-		bool exist_cube_value_positive;
-		bool exist_cube_value_negative;
-		for (size_t kz = 0; kz < Nz - 1; ++kz) {
+		for (size_t kz = kz_begin; kz < kz_end; ++kz) {
 			float const uz = kz * dz;
 			for (size_t ky = 0; ky < Ny - 1; ++ky) {
 				float const uy = ky * dy;
@@ -150,107 +134,56 @@ namespace cgp
 					for (size_t k = 0; k < 8; ++k)
 						cube.value[k] = field[cube.index[k]] - iso;
 
-					// check if there is at least one change of sign in the vertices
-					exist_cube_value_positive = false;
-					exist_cube_value_negative = false;
-					for (size_t k = 0; k < 8; ++k) {
-						if (cube.value[k] >= 0) exist_cube_value_positive = true;
-						if (cube.value[k] <  0) exist_cube_value_negative = true;
-					}
+					// Set the type of cube
+					int type = 0;
+					if (cube.value[0] < 0) type |= 1;
+					if (cube.value[1] < 0) type |= 2;
+					if (cube.value[2] < 0) type |= 4;
+					if (cube.value[3] < 0) type |= 8;
+					if (cube.value[4] < 0) type |= 16;
+					if (cube.value[5] < 0) type |= 32;
+					if (cube.value[6] < 0) type |= 64;
+					if (cube.value[7] < 0) type |= 128;
 
 					// Only pursue if there is a change of sign
-					if (exist_cube_value_positive && exist_cube_value_negative) {
-
-						// Set the type of cube
-						int type = 0;
-						if (cube.value[0] < 0) type |= 1;
-						if (cube.value[1] < 0) type |= 2;
-						if (cube.value[2] < 0) type |= 4;
-						if (cube.value[3] < 0) type |= 8;
-						if (cube.value[4] < 0) type |= 16;
-						if (cube.value[5] < 0) type |= 32;
-						if (cube.value[6] < 0) type |= 64;
-						if (cube.value[7] < 0) type |= 128;
-
-						// 3D positions of the cube vertices
-						fill_position(cube.position[0], ux   , uy   , uz   , domain_min, domain_length);
-						fill_position(cube.position[1], ux+dx, uy   , uz   , domain_min, domain_length);
-						fill_position(cube.position[2], ux+dx, uy+dy, uz   , domain_min, domain_length);
-						fill_position(cube.position[3], ux   , uy+dy, uz   , domain_min, domain_length);
-						fill_position(cube.position[4], ux   , uy   , uz+dz, domain_min, domain_length);
-						fill_position(cube.position[5], ux+dx, uy   , uz+dz, domain_min, domain_length);
-						fill_position(cube.position[6], ux+dx, uy+dy, uz+dz, domain_min, domain_length);
-						fill_position(cube.position[7], ux   , uy+dy, uz+dz, domain_min, domain_length);
-
-
-						// Compute vertex at the intersection
-						if (edgeTable[type] &    1) 
-							interpolate_position_on_edge(new_vertex[0], new_vertex_alpha[0], 0, 1, cube.position, cube.value);
-						if (edgeTable[type] &    2)
-							interpolate_position_on_edge(new_vertex[1], new_vertex_alpha[1], 1, 2, cube.position, cube.value);
-						if (edgeTable[type] &    4)
-							interpolate_position_on_edge(new_vertex[2], new_vertex_alpha[2], 2, 3, cube.position, cube.value);
-						if (edgeTable[type] &    8)
-							interpolate_position_on_edge(new_vertex[3], new_vertex_alpha[3], 3, 0, cube.position, cube.value);
-						if (edgeTable[type] &   16)
-							interpolate_position_on_edge(new_vertex[4], new_vertex_alpha[4], 4, 5, cube.position, cube.value);
-						if (edgeTable[type] &   32)
-							interpolate_position_on_edge(new_vertex[5], new_vertex_alpha[5], 5, 6, cube.position, cube.value);
-						if (edgeTable[type] &   64)
-							interpolate_position_on_edge(new_vertex[6], new_vertex_alpha[6], 6, 7, cube.position, cube.value);
-						if (edgeTable[type] &  128)
-							interpolate_position_on_edge(new_vertex[7], new_vertex_alpha[7], 7, 4, cube.position, cube.value);
-						if (edgeTable[type] &  256)
-							interpolate_position_on_edge(new_vertex[8], new_vertex_alpha[8], 0, 4, cube.position, cube.value);
-						if (edgeTable[type] &  512)
-							interpolate_position_on_edge(new_vertex[9], new_vertex_alpha[9], 1, 5, cube.position, cube.value);
-						if (edgeTable[type] & 1024)
-							interpolate_position_on_edge(new_vertex[10], new_vertex_alpha[10], 2, 6, cube.position, cube.value);
-						if (edgeTable[type] & 2048)
-							interpolate_position_on_edge(new_vertex[11], new_vertex_alpha[11], 3, 7, cube.position, cube.value);
-
-
-
-						// Construct the new triangles
-						for (size_t k = 0; triTable[type][k] != -1; k += 3) { // read the table of correspondance for the triangle
-
-							vec3 const& p0 = new_vertex[triTable[type][k  ]];
-							vec3 const& p1 = new_vertex[triTable[type][k+1]];
-							vec3 const& p2 = new_vertex[triTable[type][k+2]];
-
-							if (position.size() < counter_position + 3)
-								position.resize(1.5 * (counter_position + 3));
-							
-
-							position[counter_position] = p0;
-							position[counter_position + 1] = p1;
-							position[counter_position + 2] = p2;
-							
-
-							if (relative != nullptr) {
-								if (relative->size() < counter_position + 3) 
-									relative->resize(1.5 * (counter_position + 3));
-								
-								int const idx0 = triTable[type][k];
-								(*relative)[counter_position].alpha = new_vertex_alpha[idx0];
-								(*relative)[counter_position].k0 = cube.index[lut_edge_order[idx0].first];
-								(*relative)[counter_position].k1 = cube.index[lut_edge_order[idx0].second];
-
-								int const idx1 = triTable[type][k+1];
-								(*relative)[counter_position+1].alpha = new_vertex_alpha[idx1];
-								(*relative)[counter_position+1].k0 = cube.index[lut_edge_order[idx1].first];
-								(*relative)[counter_position+1].k1 = cube.index[lut_edge_order[idx1].second];
-
-								int const idx2 = triTable[type][k+2];
-								(*relative)[counter_position+2].alpha = new_vertex_alpha[idx2];
-								(*relative)[counter_position+2].k0 = cube.index[lut_edge_order[idx2].first];
-								(*relative)[counter_position+2].k1 = cube.index[lut_edge_order[idx2].second];
-							}
+					if (type == 0 || type == 255)
+						continue;
+
+					// Counting pass
+					if (position == nullptr) {
+						counter_position += tables.vertex_count[type];
+						continue;
+					}
+
+					// 3D positions of the cube vertices
+					fill_position(cube.position[0], ux   , uy   , uz   , domain_min, domain_length);
+					fill_position(cube.position[1], ux+dx, uy   , uz   , domain_min, domain_length);
+					fill_position(cube.position[2], ux+dx, uy+dy, uz   , domain_min, domain_length);
+					fill_position(cube.position[3], ux   , uy+dy, uz   , domain_min, domain_length);
+					fill_position(cube.position[4], ux   , uy   , uz+dz, domain_min, domain_length);
+					fill_position(cube.position[5], ux+dx, uy   , uz+dz, domain_min, domain_length);
+					fill_position(cube.position[6], ux+dx, uy+dy, uz+dz, domain_min, domain_length);
+					fill_position(cube.position[7], ux   , uy+dy, uz+dz, domain_min, domain_length);
+
 
-							counter_position += 3;
+					// Compute vertex at the intersection
+					for (int edge = 0; edge < 12; ++edge)
+						if (edgeTable[type] & (1 << edge))
+							interpolate_position_on_edge(new_vertex[edge], new_vertex_alpha[edge], lut_edge_order[edge].first, lut_edge_order[edge].second, cube.position, cube.value);
 
+
+					// Construct the new triangles
+					for (size_t k = 0; triTable[type][k] != -1; ++k) { // read the table of correspondance for the triangle
+						int const edge = triTable[type][k];
+						position[counter_position] = new_vertex[edge];
+
+						if (relative != nullptr) {
+							relative[counter_position].alpha = new_vertex_alpha[edge];
+							relative[counter_position].k0 = cube.index[lut_edge_order[edge].first];
+							relative[counter_position].k1 = cube.index[lut_edge_order[edge].second];
 						}
 
+						counter_position++;
 					}
 
 				}
@@ -258,6 +191,271 @@ namespace cgp
 		}
 
 		return counter_position;
+	}
+
+	size_t marching_cube(std::vector<vec3>& position, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative)
+	{
+		// Single slab run by the caller
+		return marching_cube(position, field, domain, iso, relative, 1, [](int task_count, std::function<void(int)> const& task) {
+			for (int k = 0; k < task_count; ++k)
+				task(k);
+		});
+	}
+
+	size_t marching_cube(std::vector<vec3>& position, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative, int slab_number, marching_cube_task_runner const& run_tasks)
+	{
+		int const Nz_cube = domain.samples.z - 1;
+		if (Nz_cube <= 0 || domain.samples.x < 2 || domain.samples.y < 2)
+			return 0;
+		slab_number = std::max(1, std::min(slab_number, Nz_cube));
+
+		// Layers of cubes [slab_begin[k], slab_begin[k+1]) along z for the slab k
+		std::vector<size_t> slab_begin(slab_number + 1);
+		for (int k = 0; k <= slab_number; ++k)
+			slab_begin[k] = size_t(k) * Nz_cube / slab_number;
+
+		// First pass: number of vertices of each slab
+		std::vector<size_t> slab_offset(slab_number + 1, 0);
+		run_tasks(slab_number, [&](int k) {
+			slab_offset[k + 1] = marching_cube_slab(field, domain, iso, slab_begin[k], slab_begin[k + 1], nullptr, nullptr);
+		});
+
+		// Exclusive prefix sum: first vertex of each slab
+		for (int k = 0; k < slab_number; ++k)
+			slab_offset[k + 1] += slab_offset[k];
+		size_t const counter_position = slab_offset[slab_number];
+
+		// The output is only resized when too small, and then directly to its final size
+		if (position.size() < counter_position)
+			position.resize(counter_position);
+		if (relative != nullptr && relative->size() < counter_position)
+			relative->resize(counter_position);
+
+		// Second pass: each slab writes its triangles from its offset, in the same order as a single pass over the whole grid
+		vec3* const position_data = position.data();
+		marching_cube_relative_coordinates* const relative_data = relative != nullptr ? relative->data() : nullptr;
+		run_tasks(slab_number, [&](int k) {
+			if (slab_offset[k + 1] > slab_offset[k])
+				marching_cube_slab(field, domain, iso, slab_begin[k], slab_begin[k + 1], position_data + slab_offset[k], relative_data != nullptr ? relative_data + slab_offset[k] : nullptr);
+		});
+
+		return counter_position;
+	}
+
+
+	// Edges of a cube in the order of lut_edge_order, located on the grid for the indexed marching cube
+	struct marching_cube_grid_edge {
+		int slice;   // 0: x/y-edge of the bottom slice of the cube, 1: x/y-edge of the top slice, 2: z-edge
+		int dx, dy;  // Offset of the first sample of the edge from the first corner of the cube
+		int axis;    // 0: edge along x, 1: along y (slices only)
+		int c0, c1;  // Corners of the cube at the ends of the edge, c0 being the one with the smallest index in the grid
+	};
+	static std::array<marching_cube_grid_edge, 12> const marching_cube_grid_edges = { {
+		{0, 0,0, 0, 0,1}, {0, 1,0, 1, 1,2}, {0, 0,1, 0, 3,2}, {0, 0,0, 1, 0,3},
+		{1, 0,0, 0, 4,5}, {1, 1,0, 1, 5,6}, {1, 0,1, 0, 7,6}, {1, 0,0, 1, 4,7},
+		{2, 0,0, 0, 0,4}, {2, 1,0, 0, 1,5}, {2, 1,1, 0, 2,6}, {2, 0,1, 0, 3,7}
+	} };
+
+	// Smallest distance of a vertex of the indexed marching cube to the ends of its edge, relative to the length of the edge
+	static float const marching_cube_min_alpha = 1e-3f;
+
+	// Triangle index referring to a vertex of the bottom slice of a slab, created by the previous slab. The other bits are the edge in the slice.
+	static unsigned int const marching_cube_shared_vertex = 0x80000000u;
+
+	// Indexed output of a slab of layers of cubes
+	struct marching_cube_indexed_slab {
+		std::vector<vec3> position;
+		std::vector<marching_cube_relative_coordinates> relative;
+		std::vector<uint3> connectivity; // Indices in position, or marching_cube_shared_vertex | edge of the bottom slice
+		std::vector<int> top_slice;       // Per x/y-edge of the top slice: index of its vertex in position, -1 if none
+	};
 
+	// Indexed marching cube over the layers of cubes [kz_begin, kz_end).
+	// The vertices are shared through the edges of two slices of samples (bottom and top of the current layer of cubes), plus the z-edges of the layer.
+	// When share_bottom is true, the vertices of the bottom slice of the slab are not created but referred to, see marching_cube_shared_vertex.
+	static void marching_cube_indexed_slab_run(marching_cube_indexed_slab& slab, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, size_t kz_begin, size_t kz_end, bool share_bottom)
+	{
+		marching_cube_tables const& tables = get_marching_cube_tables();
+		std::array<std::array<int, 16>, 256> const& triTable = tables.triTable;
+		std::array<int, 256> const& edgeTable = tables.edgeTable;
+
+		vec3 const domain_min = domain.center - domain.length / 2.0;
+		vec3 const& domain_length = domain.length;
+
+		size_t const Nx = domain.samples.x;
+		size_t const Ny = domain.samples.y;
+
+		float const dx = 1 / (Nx - 1.0f);
+		float const dy = 1 / (Ny - 1.0f);
+		float const dz = 1 / (domain.samples.z - 1.0f);
+
+		// Index of the vertex on each edge, -1 if not created yet
+		//  Slices: 2 edges per sample (along x and along y), z-edges: 1 per sample
+		std::vector<int> bottom_slice(2 * Nx * Ny, -1);
+		std::vector<int> top_slice(2 * Nx * Ny);
+		std::vector<int> z_edges(Nx * Ny);
+
+		cube_parameters cube;
+		std::array<unsigned int, 12> edge_vertex;
+
+		std::array<size_t, 8> const offset_cube = { 0, 1, 1+Nx, Nx, Nx*Ny, 1+Nx*Ny, 1+Nx+Nx*Ny, Nx+Nx*Ny };
+
+		for (size_t kz = kz_begin; kz < kz_end; ++kz) {
+			float const uz = kz * dz;
+			std::fill(top_slice.begin(), top_slice.end(), -1);
+			std::fill(z_edges.begin(), z_edges.end(), -1);
+			bool const shared_layer = share_bottom && kz == kz_begin;
+
+			for (size_t ky = 0; ky < Ny - 1; ++ky) {
+				float const uy = ky * dy;
+				for (size_t kx = 0; kx < Nx - 1; ++kx) {
+					float const ux = kx * dx;
+
+					size_t const index_corner = kx + Nx * (ky + Ny * kz);
+
+					// compute offsets of the cube vertices
+					for (size_t k_offset = 0; k_offset < 8; ++k_offset)
+						cube.index[k_offset] = index_corner + offset_cube[k_offset];
+
+					// get values
+					for (size_t k = 0; k < 8; ++k)
+						cube.value[k] = field[cube.index[k]] - iso;
+
+					// Set the type of cube
+					int type = 0;
+					if (cube.value[0] < 0) type |= 1;
+					if (cube.value[1] < 0) type |= 2;
+					if (cube.value[2] < 0) type |= 4;
+					if (cube.value[3] < 0) type |= 8;
+					if (cube.value[4] < 0) type |= 16;
+					if (cube.value[5] < 0) type |= 32;
+					if (cube.value[6] < 0) type |= 64;
+					if (cube.value[7] < 0) type |= 128;
+
+					// Only pursue if there is a change of sign
+					if (type == 0 || type == 255)
+						continue;
+
+					// 3D positions of the cube vertices
+					fill_position(cube.position[0], ux   , uy   , uz   , domain_min, domain_length);
+					fill_position(cube.position[1], ux+dx, uy   , uz   , domain_min, domain_length);
+					fill_position(cube.position[2], ux+dx, uy+dy, uz   , domain_min, domain_length);
+					fill_position(cube.position[3], ux   , uy+dy, uz   , domain_min, domain_length);
+					fill_position(cube.position[4], ux   , uy   , uz+dz, domain_min, domain_length);
+					fill_position(cube.position[5], ux+dx, uy   , uz+dz, domain_min, domain_length);
+					fill_position(cube.position[6], ux+dx, uy+dy, uz+dz, domain_min, domain_length);
+					fill_position(cube.position[7], ux   , uy+dy, uz+dz, domain_min, domain_length);
+
+					// Find or create the vertex of each intersected edge
+					for (int edge = 0; edge < 12; ++edge) {
+						if (!(edgeTable[type] & (1 << edge)))
+							continue;
+
+						marching_cube_grid_edge const& e = marching_cube_grid_edges[edge];
+						size_t const sample = (kx + e.dx) + Nx * (ky + e.dy);
+						size_t const slot = e.slice == 2 ? sample : 2 * sample + e.axis;
+						int& vertex = e.slice == 0 ? bottom_slice[slot] : (e.slice == 1 ? top_slice[slot] : z_edges[slot]);
+
+						if (vertex == -1 && e.slice == 0 && shared_layer) {
+							edge_vertex[edge] = marching_cube_shared_vertex | unsigned(slot);
+							continue;
+						}
+						if (vertex == -1) {
+							// The vertex is always interpolated from the sample with the smallest index, whatever the cube creating it.
+							// It is kept slightly away from the samples: the vertices of two edges meeting at a sample on the isovalue would be at the same position, and their triangles without area.
+							vec3 p;
+							marching_cube_relative_coordinates r;
+							interpolate_position_on_edge(p, r.alpha, e.c0, e.c1, cube.position, cube.value);
+							if (r.alpha < marching_cube_min_alpha || r.alpha > 1 - marching_cube_min_alpha) {
+								r.alpha = std::min(std::max(r.alpha, marching_cube_min_alpha), 1 - marching_cube_min_alpha);
+								p = (1 - r.alpha) * cube.position[e.c0] + r.alpha * cube.position[e.c1];
+							}
+							r.k0 = cube.index[e.c0];
+							r.k1 = cube.index[e.c1];
+
+							vertex = int(slab.position.size());
+							slab.position.push_back(p);
+							slab.relative.push_back(r);
+						}
+						edge_vertex[edge] = unsigned(vertex);
+					}
+
+					// Construct the new triangles
+					for (size_t k = 0; triTable[type][k] != -1; k += 3)
+						slab.connectivity.push_back({ edge_vertex[triTable[type][k]], edge_vertex[triTable[type][k+1]], edge_vertex[triTable[type][k+2]] });
+				}
+			}
+
+			// The top slice of this layer is the bottom slice of the next one
+			std::swap(bottom_slice, top_slice);
+		}
+
+		slab.top_slice = std::move(bottom_slice);
+	}
+
+	void marching_cube_indexed(std::vector<vec3>& position, std::vector<uint3>& connectivity, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative, int slab_number, marching_cube_task_runner const& run_tasks)
+	{
+		int const Nz_cube = domain.samples.z - 1;
+		if (Nz_cube <= 0 || domain.samples.x < 2 || domain.samples.y < 2) {
+			position.clear();
+			connectivity.clear();
+			if (relative != nullptr)
+				relative->clear();
+			return;
+		}
+		slab_number = std::max(1, std::min(slab_number, Nz_cube));
+
+		// Runs the tasks on the caller without task runner
+		auto const run = [&](std::function<void(int)> const& task) {
+			if (run_tasks)
+				run_tasks(slab_number, task);
+			else
+				for (int k = 0; k < slab_number; ++k)
+					task(k);
+		};
+
+		// First pass: indexed mesh of each slab, the vertices of its bottom slice being left to the previous slab
+		std::vector<marching_cube_indexed_slab> slabs(slab_number);
+		run([&](int k) {
+			size_t const kz_begin = size_t(k) * Nz_cube / slab_number;
+			size_t const kz_end = size_t(k + 1) * Nz_cube / slab_number;
+			marching_cube_indexed_slab_run(slabs[k], field, domain, iso, kz_begin, kz_end, k > 0);
+		});
+
+		// Exclusive prefix sums: first vertex and first triangle of each slab
+		std::vector<size_t> vertex_offset(slab_number + 1, 0);
+		std::vector<size_t> triangle_offset(slab_number + 1, 0);
+		for (int k = 0; k < slab_number; ++k) {
+			vertex_offset[k + 1] = vertex_offset[k] + slabs[k].position.size();
+			triangle_offset[k + 1] = triangle_offset[k] + slabs[k].connectivity.size();
+		}
+
+		position.resize(vertex_offset[slab_number]);
+		connectivity.resize(triangle_offset[slab_number]);
+		if (relative != nullptr)
+			relative->resize(vertex_offset[slab_number]);
+
+		// Second pass: each slab copies its vertices at its offset, and its triangles with global indices.
+		// A vertex of the bottom slice of a slab is the one of the top slice of the previous slab.
+		run([&](int k) {
+			marching_cube_indexed_slab const& slab = slabs[k];
+			std::copy(slab.position.begin(), slab.position.end(), position.begin() + vertex_offset[k]);
+			if (relative != nullptr)
+				std::copy(slab.relative.begin(), slab.relative.end(), relative->begin() + vertex_offset[k]);
+
+			for (size_t t = 0; t < slab.connectivity.size(); ++t) {
+				uint3 triangle = slab.connectivity[t];
+				for (int i = 0; i < 3; ++i) {
+					if (triangle[i] & marching_cube_shared_vertex) {
+						int const shared = slabs[k - 1].top_slice[triangle[i] & ~marching_cube_shared_vertex];
+						assert_cgp_no_msg(shared != -1);
+						triangle[i] = unsigned(vertex_offset[k - 1] + shared);
+					}
+					else
+						triangle[i] = unsigned(vertex_offset[k] + triangle[i]);
+				}
+				connectivity[triangle_offset[k] + t] = triangle;
+			}
+		});
 	}
-}
\ No newline at end of file
+}
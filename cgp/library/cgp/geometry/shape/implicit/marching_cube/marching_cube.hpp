@@ -3,11 +3,12 @@
 #include "cgp/core/containers/grid/grid.hpp"
 #include "cgp/geometry/shape/mesh/mesh.hpp"
 #include "cgp/geometry/shape/spatial_domain/spatial_domain.hpp"
+#include <functional>
 
 namespace cgp {
 
 	/** A simple-to-use marching cube that takes as input a discrete field, a 3D domain, and the iso-value, and returns a mesh without duplicating the vertices at the same position. 
-	* A new mesh is created at each call which is good for single call, but not ideal for efficiency if used in the animation loop. */
+	* A new mesh is created at each call which is good for single call, but not ideal for efficiency if used in the animation loop (see marching_cube_indexed). */
 	mesh marching_cube(grid_3D<float> const& field, spatial_domain_grid_3D const& domain, float iso);
 
 
@@ -17,9 +18,27 @@ namespace cgp {
 		float alpha;
 	};
 
-	/** A fast marching cube that generate triangles in minimizing the number of resize of not needed. The vertices of the triangles are duplicated.
+	/** A fast marching cube that generate triangles in resizing the output at most once, when it is too small. The vertices of the triangles are duplicated.
 	* - Return the actual number of valid vertices (that may be smaller than the size of the position)
 	* - If the parameter relative is not null, it is filled with the indices of the indice grid corresponding to the edge on which the vertex lie. 
 	* - Note: the parameters are set using row std::vector to handle possibly large mesh with indices using size_t instead of int */
 	size_t marching_cube(std::vector<vec3>& position, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative=nullptr);
+
+	/** Calls task(k) for every k in [0, task_count), possibly in parallel, and returns once all of them are done. */
+	typedef std::function<void(int task_count, std::function<void(int)> const& task)> marching_cube_task_runner;
+
+	/** Two-pass version of the fast marching cube, where the layers of cubes along z are split in slab_number slabs run by run_tasks.
+	* - The first pass counts the vertices of each slab, and an exclusive prefix sum over the slabs gives the first vertex of each one
+	* - position and relative are then resized once to the exact number of vertices if they are too small, and the second pass writes each slab at its offset
+	* - The output does not depend on slab_number: it is the same as the one of the single threaded version above (which is the case slab_number=1) */
+	size_t marching_cube(std::vector<vec3>& position, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative, int slab_number, marching_cube_task_runner const& run_tasks);
+
+	/** Indexed marching cube: the triangles sharing an edge of the grid share its vertex, which is stored once in position.
+	* - The vertices are found through the edges of two slices of samples (bottom and top of the current layer of cubes), so the sharing only costs memory per slice, not per sample of the grid
+	* - connectivity is filled with the triangles, as indices in position. relative, if not null, gets the edge of each vertex
+	* - The vertices are kept at 1e-3 edge length at least from the samples, so that the vertices of different edges never coincide
+	* - The layers of cubes can be split in slab_number slabs run by run_tasks (serially on the caller if empty). Each slab refers to the vertices of its bottom slice created by the previous slab,
+	*   so the output does not depend on slab_number
+	* - The output vectors are resized to their exact size, which only reallocates when they are too small */
+	void marching_cube_indexed(std::vector<vec3>& position, std::vector<uint3>& connectivity, std::vector<float> const& field, spatial_domain_grid_3D const& domain, float iso, std::vector<marching_cube_relative_coordinates>* relative=nullptr, int slab_number=1, marching_cube_task_runner const& run_tasks=marching_cube_task_runner());
 }
\ No newline at end of file
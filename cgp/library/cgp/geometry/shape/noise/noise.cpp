@@ -3,6 +3,17 @@
 #include "third_party/src/simplexnoise/simplexnoise1234.hpp"
 #include "cgp/core/base/base.hpp"
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#ifdef CGP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Permutation table of simplexnoise1234.cpp: the batched noise uses the same gradients as snoise2 and snoise3
+extern unsigned char perm[512];
+
 namespace cgp
 {
 
@@ -50,4 +61,495 @@ namespace cgp
         return value;
     }
 
-}
\ No newline at end of file
+    // Batched noise
+    // ***************************************** //
+
+    // Skewing factors of the simplex grids, as in simplexnoise1234.cpp
+    static float const F2 = 0.366025403f;
+    static float const G2 = 0.211324865f;
+    static float const F3 = 0.333333333f;
+    static float const G3 = 0.166666667f;
+
+    // The permutation table widened to 32 bits, so that it can be read with gathers
+    static int const* permutation_table()
+    {
+        static std::vector<int> const table(perm, perm + 512);
+        return table.data();
+    }
+
+    static inline int fast_floor(float x)
+    {
+        int const i = (int)x;
+        return x < i ? i - 1 : i;
+    }
+
+    // Contribution of one corner of a simplex to the noise, and to its gradient if needed.
+    //  (cx, cy, cz) is the offset of the point from the corner, (gx, gy, gz) the gradient of the corner, t the positive kernel r^2 - |c|^2.
+    template <bool derivatives>
+    static inline void add_corner(float t, float cx, float cy, float cz, float gx, float gy, float gz, float& n, float& dx, float& dy, float& dz)
+    {
+        float const t2 = t * t;
+        float const t4 = t2 * t2;
+        float const dot = gx * cx + gy * cy + gz * cz;
+        n += t4 * dot;
+        if (derivatives) {
+            float const w = -8 * t2 * t * dot;
+            dx += t4 * gx + w * cx;
+            dy += t4 * gy + w * cy;
+            dz += t4 * gz + w * cz;
+        }
+    }
+
+    // Corner (i, j) of a 2D simplex. Corners further than the radius of the kernel do not contribute, and their gradient is not read.
+    template <bool derivatives>
+    static inline void add_corner_2(int const* P, int i, int j, float cx, float cy, float& n, float& dx, float& dy)
+    {
+        float const t = 0.5f - cx * cx - cy * cy;
+        if (t <= 0)
+            return;
+
+        // Gradients of grad2: (+-1, +-2) or (+-2, +-1)
+        int const h = P[i + P[j]] & 7;
+        float const a = (h & 1) ? -1.0f : 1.0f;
+        float const b = (h & 2) ? -2.0f : 2.0f;
+        float dz = 0;
+        add_corner<derivatives>(t, cx, cy, 0, h < 4 ? a : b, h < 4 ? b : a, 0, n, dx, dy, dz);
+    }
+
+    // Corner (i, j, k) of a 3D simplex
+    template <bool derivatives>
+    static inline void add_corner_3(int const* P, int i, int j, int k, float cx, float cy, float cz, float& n, float& dx, float& dy, float& dz)
+    {
+        float const t = 0.6f - cx * cx - cy * cy - cz * cz;
+        if (t <= 0)
+            return;
+
+        // Gradients of grad3: the middles of the edges of a cube
+        int const h = P[i + P[j + P[k]]] & 15;
+        float const u = (h & 1) ? -1.0f : 1.0f;
+        float const v = (h & 2) ? -1.0f : 1.0f;
+        bool const v_is_x = h == 12 || h == 14;
+        float const gx = (h < 8 ? u : 0) + (v_is_x ? v : 0);
+        float const gy = (h < 8 ? 0 : u) + (h < 4 ? v : 0);
+        float const gz = (h >= 4 && !v_is_x) ? v : 0;
+        add_corner<derivatives>(t, cx, cy, cz, gx, gy, gz, n, dx, dy, dz);
+    }
+
+    // Single precision version of snoise2, with its gradient if needed
+    template <bool derivatives>
+    static float simplex_noise(int const* P, float x, float y, float& dx, float& dy)
+    {
+        // Cell of the simplex grid, and offsets of the point from its three corners
+        float const s = (x + y) * F2;
+        int const i = fast_floor(x + s);
+        int const j = fast_floor(y + s);
+        float const t = (i + j) * G2;
+        float const x0 = x - (i - t);
+        float const y0 = y - (j - t);
+        int const i1 = x0 > y0 ? 1 : 0;
+        int const j1 = 1 - i1;
+
+        int const ii = i & 255;
+        int const jj = j & 255;
+        float n = 0;
+        dx = dy = 0;
+        add_corner_2<derivatives>(P, ii, jj, x0, y0, n, dx, dy);
+        add_corner_2<derivatives>(P, ii + i1, jj + j1, x0 - i1 + G2, y0 - j1 + G2, n, dx, dy);
+        add_corner_2<derivatives>(P, ii + 1, jj + 1, x0 - 1 + 2 * G2, y0 - 1 + 2 * G2, n, dx, dy);
+        dx *= 40;
+        dy *= 40;
+        return 40 * n;
+    }
+
+    // Single precision version of snoise3, with its gradient if needed
+    template <bool derivatives>
+    static float simplex_noise(int const* P, float x, float y, float z, float& dx, float& dy, float& dz)
+    {
+        // Cell of the simplex grid, and offsets of the point from its four corners
+        float const s = (x + y + z) * F3;
+        int const i = fast_floor(x + s);
+        int const j = fast_floor(y + s);
+        int const k = fast_floor(z + s);
+        float const t = (i + j + k) * G3;
+        float const x0 = x - (i - t);
+        float const y0 = y - (j - t);
+        float const z0 = z - (k - t);
+
+        // Order of the coordinates, giving the second and third corners
+        bool const xy = x0 >= y0, yz = y0 >= z0, xz = x0 >= z0;
+        int const i1 = xy && xz, j1 = !xy && yz, k1 = !xz && !yz;
+        int const i2 = xy || xz, j2 = !xy || yz, k2 = !(xz && yz);
+
+        int const ii = i & 255;
+        int const jj = j & 255;
+        int const kk = k & 255;
+        float n = 0;
+        dx = dy = dz = 0;
+        add_corner_3<derivatives>(P, ii, jj, kk, x0, y0, z0, n, dx, dy, dz);
+        add_corner_3<derivatives>(P, ii + i1, jj + j1, kk + k1, x0 - i1 + G3, y0 - j1 + G3, z0 - k1 + G3, n, dx, dy, dz);
+        add_corner_3<derivatives>(P, ii + i2, jj + j2, kk + k2, x0 - i2 + 2 * G3, y0 - j2 + 2 * G3, z0 - k2 + 2 * G3, n, dx, dy, dz);
+        add_corner_3<derivatives>(P, ii + 1, jj + 1, kk + 1, x0 - 1 + 3 * G3, y0 - 1 + 3 * G3, z0 - 1 + 3 * G3, n, dx, dy, dz);
+        dx *= 32;
+        dy *= 32;
+        dz *= 32;
+        return 32 * n;
+    }
+
+#ifdef CGP_SIMD_X86
+
+    // AVX2 versions of the functions above, for 8 points at a time
+
+    CGP_TARGET_AVX2
+    static inline __m256 blend(__m256 mask, __m256 a, __m256 b)
+    {
+        return _mm256_blendv_ps(b, a, mask);
+    }
+
+    CGP_TARGET_AVX2
+    static inline __m256 mask_of(__m256i bits)
+    {
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(bits, _mm256_setzero_si256()));
+    }
+
+    CGP_TARGET_AVX2
+    static inline __m256i lookup(int const* P, __m256i index)
+    {
+        return _mm256_i32gather_epi32(P, index, 4);
+    }
+
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static inline void add_corner(__m256 r2, __m256 cx, __m256 cy, __m256 cz, __m256 gx, __m256 gy, __m256 gz, __m256& n, __m256& dx, __m256& dy, __m256& dz)
+    {
+        __m256 t = _mm256_fnmadd_ps(cx, cx, r2);
+        t = _mm256_fnmadd_ps(cy, cy, t);
+        t = _mm256_fnmadd_ps(cz, cz, t);
+        t = _mm256_max_ps(t, _mm256_setzero_ps());
+        __m256 const t2 = _mm256_mul_ps(t, t);
+        __m256 const t4 = _mm256_mul_ps(t2, t2);
+        __m256 const dot = _mm256_fmadd_ps(gz, cz, _mm256_fmadd_ps(gy, cy, _mm256_mul_ps(gx, cx)));
+        n = _mm256_fmadd_ps(t4, dot, n);
+        if (derivatives) {
+            __m256 const w = _mm256_mul_ps(_mm256_set1_ps(-8.0f), _mm256_mul_ps(_mm256_mul_ps(t2, t), dot));
+            dx = _mm256_fmadd_ps(w, cx, _mm256_fmadd_ps(t4, gx, dx));
+            dy = _mm256_fmadd_ps(w, cy, _mm256_fmadd_ps(t4, gy, dy));
+            dz = _mm256_fmadd_ps(w, cz, _mm256_fmadd_ps(t4, gz, dz));
+        }
+    }
+
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static __m256 simplex_noise_x8(__m256 x, __m256 y, __m256& dx, __m256& dy)
+    {
+        int const* P = permutation_table();
+        __m256 const one = _mm256_set1_ps(1.0f);
+        __m256 const g2 = _mm256_set1_ps(G2);
+        __m256i const one_i = _mm256_set1_epi32(1);
+        __m256i const mask_255 = _mm256_set1_epi32(255);
+
+        __m256 const s = _mm256_mul_ps(_mm256_add_ps(x, y), _mm256_set1_ps(F2));
+        __m256 const fi = _mm256_floor_ps(_mm256_add_ps(x, s));
+        __m256 const fj = _mm256_floor_ps(_mm256_add_ps(y, s));
+        __m256 const t = _mm256_mul_ps(_mm256_add_ps(fi, fj), g2);
+        __m256 const x0 = _mm256_sub_ps(x, _mm256_sub_ps(fi, t));
+        __m256 const y0 = _mm256_sub_ps(y, _mm256_sub_ps(fj, t));
+        __m256 const lower = _mm256_cmp_ps(x0, y0, _CMP_GT_OQ);
+        __m256 const i1 = _mm256_and_ps(lower, one);
+        __m256 const j1 = _mm256_sub_ps(one, i1);
+        __m256 const cx[3] = { x0, _mm256_add_ps(_mm256_sub_ps(x0, i1), g2), _mm256_add_ps(_mm256_sub_ps(x0, one), _mm256_set1_ps(2 * G2)) };
+        __m256 const cy[3] = { y0, _mm256_add_ps(_mm256_sub_ps(y0, j1), g2), _mm256_add_ps(_mm256_sub_ps(y0, one), _mm256_set1_ps(2 * G2)) };
+
+        __m256i const ii = _mm256_and_si256(_mm256_cvttps_epi32(fi), mask_255);
+        __m256i const jj = _mm256_and_si256(_mm256_cvttps_epi32(fj), mask_255);
+        __m256i const i1i = _mm256_cvttps_epi32(i1);
+        __m256i const j1i = _mm256_cvttps_epi32(j1);
+        __m256i const hash[3] = {
+            lookup(P, _mm256_add_epi32(ii, lookup(P, jj))),
+            lookup(P, _mm256_add_epi32(_mm256_add_epi32(ii, i1i), lookup(P, _mm256_add_epi32(jj, j1i)))),
+            lookup(P, _mm256_add_epi32(_mm256_add_epi32(ii, one_i), lookup(P, _mm256_add_epi32(jj, one_i)))) };
+
+        __m256 const zero = _mm256_setzero_ps();
+        __m256 n = zero, dz = zero;
+        dx = dy = zero;
+        for (int c = 0; c < 3; c++) {
+            __m256i const h = hash[c];
+            __m256 const a = _mm256_cvtepi32_ps(_mm256_sub_epi32(one_i, _mm256_slli_epi32(_mm256_and_si256(h, one_i), 1)));             // 1 - 2 (h & 1)
+            __m256 const b = _mm256_cvtepi32_ps(_mm256_sub_epi32(one_i, _mm256_and_si256(h, _mm256_set1_epi32(2))));               // 1 - (h & 2)
+            __m256 const low = mask_of(_mm256_and_si256(h, _mm256_set1_epi32(4)));
+            __m256 const b2 = _mm256_add_ps(b, b);
+            add_corner<derivatives>(_mm256_set1_ps(0.5f), cx[c], cy[c], zero, blend(low, a, b2), blend(low, b2, a), zero, n, dx, dy, dz);
+        }
+        __m256 const scale = _mm256_set1_ps(40.0f);
+        dx = _mm256_mul_ps(dx, scale);
+        dy = _mm256_mul_ps(dy, scale);
+        return _mm256_mul_ps(n, scale);
+    }
+
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static __m256 simplex_noise_x8(__m256 x, __m256 y, __m256 z, __m256& dx, __m256& dy, __m256& dz)
+    {
+        int const* P = permutation_table();
+        __m256 const one = _mm256_set1_ps(1.0f);
+        __m256 const g3 = _mm256_set1_ps(G3);
+        __m256i const one_i = _mm256_set1_epi32(1);
+        __m256i const mask_255 = _mm256_set1_epi32(255);
+
+        __m256 const s = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(x, y), z), _mm256_set1_ps(F3));
+        __m256 const fi = _mm256_floor_ps(_mm256_add_ps(x, s));
+        __m256 const fj = _mm256_floor_ps(_mm256_add_ps(y, s));
+        __m256 const fk = _mm256_floor_ps(_mm256_add_ps(z, s));
+        __m256 const t = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(fi, fj), fk), g3);
+        __m256 const x0 = _mm256_sub_ps(x, _mm256_sub_ps(fi, t));
+        __m256 const y0 = _mm256_sub_ps(y, _mm256_sub_ps(fj, t));
+        __m256 const z0 = _mm256_sub_ps(z, _mm256_sub_ps(fk, t));
+
+        __m256 const xy = _mm256_cmp_ps(x0, y0, _CMP_GE_OQ);
+        __m256 const yz = _mm256_cmp_ps(y0, z0, _CMP_GE_OQ);
+        __m256 const xz = _mm256_cmp_ps(x0, z0, _CMP_GE_OQ);
+        __m256 const i1 = _mm256_and_ps(_mm256_and_ps(xy, xz), one);
+        __m256 const j1 = _mm256_and_ps(_mm256_andnot_ps(xy, yz), one);
+        __m256 const k1 = _mm256_andnot_ps(_mm256_or_ps(xz, yz), one);
+        __m256 const i2 = _mm256_and_ps(_mm256_or_ps(xy, xz), one);
+        __m256 const j2 = _mm256_sub_ps(one, _mm256_andnot_ps(yz, _mm256_and_ps(xy, one)));
+        __m256 const k2 = _mm256_sub_ps(one, _mm256_and_ps(_mm256_and_ps(xz, yz), one));
+        __m256 const cx[4] = { x0, _mm256_add_ps(_mm256_sub_ps(x0, i1), g3), _mm256_add_ps(_mm256_sub_ps(x0, i2), _mm256_set1_ps(2 * G3)), _mm256_add_ps(_mm256_sub_ps(x0, one), _mm256_set1_ps(3 * G3)) };
+        __m256 const cy[4] = { y0, _mm256_add_ps(_mm256_sub_ps(y0, j1), g3), _mm256_add_ps(_mm256_sub_ps(y0, j2), _mm256_set1_ps(2 * G3)), _mm256_add_ps(_mm256_sub_ps(y0, one), _mm256_set1_ps(3 * G3)) };
+        __m256 const cz[4] = { z0, _mm256_add_ps(_mm256_sub_ps(z0, k1), g3), _mm256_add_ps(_mm256_sub_ps(z0, k2), _mm256_set1_ps(2 * G3)), _mm256_add_ps(_mm256_sub_ps(z0, one), _mm256_set1_ps(3 * G3)) };
+
+        __m256i const ii = _mm256_and_si256(_mm256_cvttps_epi32(fi), mask_255);
+        __m256i const jj = _mm256_and_si256(_mm256_cvttps_epi32(fj), mask_255);
+        __m256i const kk = _mm256_and_si256(_mm256_cvttps_epi32(fk), mask_255);
+        __m256i const offset_i[4] = { _mm256_setzero_si256(), _mm256_cvttps_epi32(i1), _mm256_cvttps_epi32(i2), one_i };
+        __m256i const offset_j[4] = { _mm256_setzero_si256(), _mm256_cvttps_epi32(j1), _mm256_cvttps_epi32(j2), one_i };
+        __m256i const offset_k[4] = { _mm256_setzero_si256(), _mm256_cvttps_epi32(k1), _mm256_cvttps_epi32(k2), one_i };
+
+        __m256 const zero = _mm256_setzero_ps();
+        __m256 n = zero;
+        dx = dy = dz = zero;
+        for (int c = 0; c < 4; c++) {
+            __m256i const hk = lookup(P, _mm256_add_epi32(kk, offset_k[c]));
+            __m256i const hj = lookup(P, _mm256_add_epi32(_mm256_add_epi32(jj, offset_j[c]), hk));
+            __m256i const h = _mm256_and_si256(lookup(P, _mm256_add_epi32(_mm256_add_epi32(ii, offset_i[c]), hj)), _mm256_set1_epi32(15));
+
+            __m256 const u = _mm256_cvtepi32_ps(_mm256_sub_epi32(one_i, _mm256_slli_epi32(_mm256_and_si256(h, one_i), 1))); // 1 - 2 (h & 1)
+            __m256 const v = _mm256_cvtepi32_ps(_mm256_sub_epi32(one_i, _mm256_and_si256(h, _mm256_set1_epi32(2))));        // 1 - (h & 2)
+            __m256 const u_is_x = mask_of(_mm256_and_si256(h, _mm256_set1_epi32(8)));
+            __m256 const v_is_y = mask_of(_mm256_and_si256(h, _mm256_set1_epi32(12)));
+            __m256 const v_is_x = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(h, _mm256_set1_epi32(13)), _mm256_set1_epi32(12)));
+            __m256 const v_is_z = _mm256_andnot_ps(_mm256_or_ps(v_is_x, v_is_y), _mm256_castsi256_ps(_mm256_set1_epi32(-1)));
+
+            __m256 const gx = _mm256_add_ps(_mm256_and_ps(u_is_x, u), _mm256_and_ps(v_is_x, v));
+            __m256 const gy = _mm256_add_ps(_mm256_andnot_ps(u_is_x, u), _mm256_and_ps(v_is_y, v));
+            __m256 const gz = _mm256_and_ps(v_is_z, v);
+            add_corner<derivatives>(_mm256_set1_ps(0.6f), cx[c], cy[c], cz[c], gx, gy, gz, n, dx, dy, dz);
+        }
+        __m256 const scale = _mm256_set1_ps(32.0f);
+        dx = _mm256_mul_ps(dx, scale);
+        dy = _mm256_mul_ps(dy, scale);
+        dz = _mm256_mul_ps(dz, scale);
+        return _mm256_mul_ps(n, scale);
+    }
+
+    // Sum of the octaves for 8 points, see noise_perlin
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static __m256 noise_perlin_x8(__m256 x, __m256 y, int octave, float persistency, float frequency_gain, __m256& dx, __m256& dy)
+    {
+        __m256 const half = _mm256_set1_ps(0.5f);
+        __m256 value = _mm256_setzero_ps();
+        dx = dy = _mm256_setzero_ps();
+        float a = 1.0f; // current magnitude
+        float f = 1.0f; // current frequency
+        for (int k = 0; k < octave; k++)
+        {
+            __m256 const frequency = _mm256_set1_ps(f);
+            __m256 nx, ny;
+            __m256 const n = simplex_noise_x8<derivatives>(_mm256_mul_ps(x, frequency), _mm256_mul_ps(y, frequency), nx, ny);
+            __m256 const magnitude = _mm256_set1_ps(a);
+            __m256 const slope = _mm256_set1_ps(0.5f * a * f);
+            value = _mm256_fmadd_ps(magnitude, _mm256_fmadd_ps(half, n, half), value);
+            dx = _mm256_fmadd_ps(slope, nx, dx);
+            dy = _mm256_fmadd_ps(slope, ny, dy);
+            f *= frequency_gain;
+            a *= persistency;
+        }
+        return value;
+    }
+
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static __m256 noise_perlin_x8(__m256 x, __m256 y, __m256 z, int octave, float persistency, float frequency_gain, __m256& dx, __m256& dy, __m256& dz)
+    {
+        __m256 const half = _mm256_set1_ps(0.5f);
+        __m256 value = _mm256_setzero_ps();
+        dx = dy = dz = _mm256_setzero_ps();
+        float a = 1.0f; // current magnitude
+        float f = 1.0f; // current frequency
+        for (int k = 0; k < octave; k++)
+        {
+            __m256 const frequency = _mm256_set1_ps(f);
+            __m256 nx, ny, nz;
+            __m256 const n = simplex_noise_x8<derivatives>(_mm256_mul_ps(x, frequency), _mm256_mul_ps(y, frequency), _mm256_mul_ps(z, frequency), nx, ny, nz);
+            __m256 const magnitude = _mm256_set1_ps(a);
+            __m256 const slope = _mm256_set1_ps(0.5f * a * f);
+            value = _mm256_fmadd_ps(magnitude, _mm256_fmadd_ps(half, n, half), value);
+            dx = _mm256_fmadd_ps(slope, nx, dx);
+            dy = _mm256_fmadd_ps(slope, ny, dy);
+            dz = _mm256_fmadd_ps(slope, nz, dz);
+            f *= frequency_gain;
+            a *= persistency;
+        }
+        return value;
+    }
+
+    // The last points (less than 8) are copied into padded buffers
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static void noise_perlin_batch_avx2(float const* x, float const* y, int count, float* value, int octave, float persistency, float frequency_gain, float scale, float* dx, float* dy)
+    {
+        __m256 const s = _mm256_set1_ps(scale);
+        for (int i = 0; i < count; i += 8)
+        {
+            int const n = std::min(8, count - i);
+            float px[8] = {}, py[8] = {}, v[8], gx[8], gy[8];
+            std::copy(x + i, x + i + n, px);
+            std::copy(y + i, y + i + n, py);
+
+            __m256 nx, ny;
+            _mm256_storeu_ps(v, noise_perlin_x8<derivatives>(_mm256_mul_ps(_mm256_loadu_ps(px), s), _mm256_mul_ps(_mm256_loadu_ps(py), s), octave, persistency, frequency_gain, nx, ny));
+            std::copy(v, v + n, value + i);
+            if (derivatives) {
+                _mm256_storeu_ps(gx, _mm256_mul_ps(nx, s));
+                _mm256_storeu_ps(gy, _mm256_mul_ps(ny, s));
+                std::copy(gx, gx + n, dx + i);
+                std::copy(gy, gy + n, dy + i);
+            }
+        }
+    }
+
+    template <bool derivatives>
+    CGP_TARGET_AVX2
+    static void noise_perlin_batch_avx2(float const* x, float const* y, float const* z, int count, float* value, int octave, float persistency, float frequency_gain, float scale, float* dx, float* dy, float* dz)
+    {
+        __m256 const s = _mm256_set1_ps(scale);
+        for (int i = 0; i < count; i += 8)
+        {
+            int const n = std::min(8, count - i);
+            float px[8] = {}, py[8] = {}, pz[8] = {}, v[8], gx[8], gy[8], gz[8];
+            std::copy(x + i, x + i + n, px);
+            std::copy(y + i, y + i + n, py);
+            std::copy(z + i, z + i + n, pz);
+
+            __m256 nx, ny, nz;
+            _mm256_storeu_ps(v, noise_perlin_x8<derivatives>(_mm256_mul_ps(_mm256_loadu_ps(px), s), _mm256_mul_ps(_mm256_loadu_ps(py), s), _mm256_mul_ps(_mm256_loadu_ps(pz), s), octave, persistency, frequency_gain, nx, ny, nz));
+            std::copy(v, v + n, value + i);
+            if (derivatives) {
+                _mm256_storeu_ps(gx, _mm256_mul_ps(nx, s));
+                _mm256_storeu_ps(gy, _mm256_mul_ps(ny, s));
+                _mm256_storeu_ps(gz, _mm256_mul_ps(nz, s));
+                std::copy(gx, gx + n, dx + i);
+                std::copy(gy, gy + n, dy + i);
+                std::copy(gz, gz + n, dz + i);
+            }
+        }
+    }
+
+#endif
+
+    // Versions of noise_perlin_batch without SIMD, one point at a time
+    template <bool derivatives>
+    static void noise_perlin_batch_scalar(float const* x, float const* y, int count, float* value, int octave, float persistency, float frequency_gain, float scale, float* dx, float* dy)
+    {
+        int const* P = permutation_table();
+        for (int i = 0; i < count; i++)
+        {
+            float v = 0.0f, gx = 0.0f, gy = 0.0f;
+            float a = 1.0f; // current magnitude
+            float f = 1.0f; // current frequency
+            for (int k = 0; k < octave; k++)
+            {
+                float nx, ny;
+                float const n = simplex_noise<derivatives>(P, x[i] * scale * f, y[i] * scale * f, nx, ny);
+                v += a * (0.5f + 0.5f * n);
+                if (derivatives) {
+                    gx += 0.5f * a * f * nx;
+                    gy += 0.5f * a * f * ny;
+                }
+                f *= frequency_gain;
+                a *= persistency;
+            }
+            value[i] = v;
+            if (derivatives) {
+                dx[i] = gx * scale;
+                dy[i] = gy * scale;
+            }
+        }
+    }
+
+    template <bool derivatives>
+    static void noise_perlin_batch_scalar(float const* x, float const* y, float const* z, int count, float* value, int octave, float persistency, float frequency_gain, float scale, float* dx, float* dy, float* dz)
+    {
+        int const* P = permutation_table();
+        for (int i = 0; i < count; i++)
+        {
+            float v = 0.0f, gx = 0.0f, gy = 0.0f, gz = 0.0f;
+            float a = 1.0f; // current magnitude
+            float f = 1.0f; // current frequency
+            for (int k = 0; k < octave; k++)
+            {
+                float nx, ny, nz;
+                float const n = simplex_noise<derivatives>(P, x[i] * scale * f, y[i] * scale * f, z[i] * scale * f, nx, ny, nz);
+                v += a * (0.5f + 0.5f * n);
+                if (derivatives) {
+                    gx += 0.5f * a * f * nx;
+                    gy += 0.5f * a * f * ny;
+                    gz += 0.5f * a * f * nz;
+                }
+                f *= frequency_gain;
+                a *= persistency;
+            }
+            value[i] = v;
+            if (derivatives) {
+                dx[i] = gx * scale;
+                dy[i] = gy * scale;
+                dz[i] = gz * scale;
+            }
+        }
+    }
+
+    void noise_perlin_batch(float const* x, float const* y, int count, float* value, int octave, float persistency, float frequency_gain, float scale, float* dx, float* dy)
+    {
+#ifdef CGP_SIMD_X86
+        if (cpu_has_avx2()) {
+            if (dx != nullptr)
+                noise_perlin_batch_avx2<true>(x, y, count, value, octave, persistency, frequency_gain, scale, dx, dy);
+            else
+                noise_perlin_batch_avx2<false>(x, y, count, value, octave, persistency, frequency_gain, scale, dx, dy);
+            return;
+        }
+#endif
+        if (dx != nullptr)
+            noise_perlin_batch_scalar<true>(x, y, count, value, octave, persistency, frequency_gain, scale, dx, dy);
+        else
+            noise_perlin_batch_scalar<false>(x, y, count, value, octave, persistency, frequency_gain, scale, dx, dy);
+    }
+
+    void noise_perlin_batch(float const* x, float const* y, float const* z, int count, float* value, int octave, float persistency, float frequency_gain, float scale, float* dx, float* dy, float* dz)
+    {
+#ifdef CGP_SIMD_X86
+        if (cpu_has_avx2()) {
+            if (dx != nullptr)
+                noise_perlin_batch_avx2<true>(x, y, z, count, value, octave, persistency, frequency_gain, scale, dx, dy, dz);
+            else
+                noise_perlin_batch_avx2<false>(x, y, z, count, value, octave, persistency, frequency_gain, scale, dx, dy, dz);
+            return;
+        }
+#endif
+        if (dx != nullptr)
+            noise_perlin_batch_scalar<true>(x, y, z, count, value, octave, persistency, frequency_gain, scale, dx, dy, dz);
+        else
+            noise_perlin_batch_scalar<false>(x, y, z, count, value, octave, persistency, frequency_gain, scale, dx, dy, dz);
+    }
+
+}
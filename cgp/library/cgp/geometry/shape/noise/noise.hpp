@@ -7,4 +7,11 @@ namespace cgp
 	float noise_perlin(float x,       int octave=5, float persistency=0.3f, float frequency_gain=2.0f);
 	float noise_perlin(vec2 const& p, int octave=5, float persistency=0.3f, float frequency_gain=2.0f);
 	float noise_perlin(vec3 const& p, int octave=5, float persistency=0.3f, float frequency_gain=2.0f);
+
+	// Batched versions of noise_perlin, evaluating count points given as arrays of coordinates with the loop over the octaves inside.
+	//  The points are computed 8 at a time with AVX2 when the processor supports it, one at a time otherwise, in single precision.
+	//  The coordinates are multiplied by scale before the first octave.
+	//  When dx is not null, the derivatives of the noise with respect to the (unscaled) coordinates are written in dx, dy (and dz).
+	void noise_perlin_batch(float const* x, float const* y, int count, float* value, int octave=5, float persistency=0.3f, float frequency_gain=2.0f, float scale=1.0f, float* dx=nullptr, float* dy=nullptr);
+	void noise_perlin_batch(float const* x, float const* y, float const* z, int count, float* value, int octave=5, float persistency=0.3f, float frequency_gain=2.0f, float scale=1.0f, float* dx=nullptr, float* dy=nullptr, float* dz=nullptr);
 }
\ No newline at end of file
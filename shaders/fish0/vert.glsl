@@ -8,9 +8,9 @@ layout (location = 1) in vec3 vertex_normal;   // vertex normal in local space
 layout (location = 2) in vec3 vertex_color;    // vertex color      (r,g,b)
 layout (location = 3) in vec2 vertex_uv;       // vertex uv-texture (u,v)
 uniform float time;
-uniform vec3 head_position;
-uniform vec3 direction;
-uniform float frequency;
+// Per-instance attributes: one fish per instance
+layout(location = 4) in vec4 instance_position_phase;      // position of the fish (xyz), phase of the swim animation (w)
+layout(location = 5) in vec4 instance_direction_frequency; // heading of the fish (xyz), frequency of the swim animation (w)
 // Output variables sent to the fragment shader
 out struct fragment_data
 {
@@ -38,6 +38,16 @@ mat3 rotationMatrix(vec3 axis, float angle)
 		oc * axis.x * axis.y + axis.z * s, oc * axis.y * axis.y + c, oc * axis.y * axis.z - axis.x * s,
 		oc * axis.z * axis.x - axis.y * s, oc * axis.y * axis.z + axis.x * s, oc * axis.z * axis.z + c);
 }
+// Rotation sending the local z axis of the mesh along the heading, and the local y axis upward
+mat3 headingMatrix(vec3 direction)
+{
+	vec3 forward = normalize(direction);
+	float horizontal = length(forward.xy);
+	vec3 side = horizontal > 1e-5 ? vec3(-forward.y, forward.x, 0.0) / horizontal : vec3(0.0, 1.0, 0.0);
+	vec3 up = cross(forward, side);
+	return mat3(side, up, forward);
+}
+
 float rand(float val)
 {
 	return sin(val* 12.9898 * 43758.5453);
@@ -45,6 +55,9 @@ float rand(float val)
 
 void main()
 {
+	float frequency = instance_direction_frequency.w;
+	float phase = instance_position_phase.w;
+	mat3 heading = headingMatrix(instance_direction_frequency.xyz);
 
 
 
@@ -54,14 +67,15 @@ void main()
 	float amplitude=0;
 	if (vertex_position.z<-0.2)
 		amplitude = amplitude_coef*pow(vertex_position.z,2);
-	vec3 real_vertex_position = vertex_position + amplitude * sin(frequency * (100 + time)) * vec3(1, 0, 0);
-	real_vertex_position += +vertical_amplitude * sin(0.3 * frequency * (100 + time)+vertex_position.z) * vec3(0, 1, 1);
+	vec3 real_vertex_position = vertex_position + amplitude * sin(frequency * (100 + time) + phase) * vec3(1, 0, 0);
+	real_vertex_position += +vertical_amplitude * sin(0.3 * frequency * (100 + time) + phase + vertex_position.z) * vec3(0, 1, 1);
 	
 	// The position of the vertex in the world space
-	vec4 position = model * vec4(real_vertex_position, 1.0);
+	// The model matrix only scales the mesh, the instance then orients and places it
+	vec4 position = vec4(instance_position_phase.xyz + heading * (model * vec4(real_vertex_position, 1.0)).xyz, 1.0);
 	
 	// The normal of the vertex in the world space
-	vec4 normal = modelNormal * vec4(vertex_normal, 0.0);
+	vec4 normal = vec4(heading * (modelNormal * vec4(vertex_normal, 0.0)).xyz, 0.0);
 
 	// The projected position of the vertex in the normalized device coordinates:
 	vec4 position_projected = projection * view * position;
@@ -20,6 +20,7 @@ in struct fragment_data
     vec2 uv;       // current uv-texture on the fragment
 
 } fragment;
+in float opacity_multiplier; // Fade out at the end of the particle lifetime
 
 // Output of the fragment shader - output color
 layout(location=0) out vec4 FragColor;
@@ -68,9 +69,6 @@ uniform vec3 fog_color;
 uniform float water_attenuation_coefficient;
 uniform float scale;
 
-// Specific to particles
-uniform float opacity_multiplier;
-
 // Depth buffer calculation
 /***************************************************************************************************/
 uniform float depth_min;
@@ -7,6 +7,9 @@ layout (location = 0) in vec3 vertex_position; // vertex position in local space
 layout (location = 1) in vec3 vertex_normal;   // vertex normal in local space   (nx,ny,nz)
 layout (location = 2) in vec3 vertex_color;    // vertex color      (r,g,b)
 layout (location = 3) in vec2 vertex_uv;       // vertex uv-texture (u,v)
+// Per-instance attributes: one particle per instance
+layout (location = 4) in vec4 instance_position_scale; // position of the particle (xyz), scale (w)
+layout (location = 5) in vec2 instance_angle_opacity;  // rotation of the quad in its plane (x), opacity multiplier (y)
 
 // Output variables sent to the fragment shader
 out struct fragment_data
@@ -16,9 +19,10 @@ out struct fragment_data
     vec3 color;    // vertex color
     vec2 uv;       // vertex uv
 } fragment;
+out float opacity_multiplier;
 
 // Uniform variables expected to receive from the C++ program
-uniform mat4 model; // Model affine transform matrix associated to the current shape
+uniform mat4 model; // Model affine transform matrix associated to the current shape, without translation
 uniform mat4 view;  // View matrix (rigid transform) of the camera
 uniform mat4 projection; // Projection (perspective or orthogonal) matrix of the camera
 
@@ -28,8 +32,15 @@ uniform mat4 modelNormal; // Model without scaling used for the normal. modelNor
 
 void main()
 {
+	// Rotation of the quad around its center, in its plane (xz)
+	float c = cos(instance_angle_opacity.x);
+	float s = sin(instance_angle_opacity.x);
+	vec3 centered = vertex_position - vec3(0.0, 0.0, 0.5);
+	vec3 rotated = vec3(c * centered.x - s * centered.z, centered.y, s * centered.x + c * centered.z) + vec3(0.0, 0.0, 0.5);
+
 	// The position of the vertex in the world space
-	vec4 position = model * vec4(vertex_position, 1.0);
+	vec4 position = model * vec4(instance_position_scale.w * rotated, 1.0);
+	position.xyz += instance_position_scale.xyz;
 
 	// The normal of the vertex in the world space
 	vec4 normal = modelNormal * vec4(vertex_normal, 0.0);
@@ -42,6 +53,7 @@ void main()
 	fragment.normal   = normal.xyz;
 	fragment.color = vertex_color;
 	fragment.uv = vertex_uv;
+	opacity_multiplier = instance_angle_opacity.y;
 
 	// gl_Position is a built-in variable which is the expected output of the vertex shader
 	gl_Position = position_projected; // gl_Position is the projected vertex position (in normalized device coordinates)
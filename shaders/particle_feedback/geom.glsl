@@ -0,0 +1,34 @@
+#version 330 core
+
+// Geometry shader of the particle transform feedback pass - only the surviving particles are written to the next state buffer
+
+layout (points) in;
+layout (points, max_vertices = 1) out;
+
+in particle_data
+{
+	vec4 position_scale;
+	vec2 angle_opacity;
+	vec3 velocity;
+	vec3 rotation_time_lifetime;
+} particle[];
+
+// Captured by the transform feedback, interleaved in the order of gpu_particle_system::state
+out vec4 out_position_scale;
+out vec2 out_angle_opacity;
+out vec3 out_velocity;
+out vec3 out_rotation_time_lifetime;
+
+void main()
+{
+	// Dead once the time lived exceeds the lifetime
+	if (particle[0].rotation_time_lifetime.y > particle[0].rotation_time_lifetime.z)
+		return;
+
+	out_position_scale = particle[0].position_scale;
+	out_angle_opacity = particle[0].angle_opacity;
+	out_velocity = particle[0].velocity;
+	out_rotation_time_lifetime = particle[0].rotation_time_lifetime;
+	EmitVertex();
+	EndPrimitive();
+}
@@ -0,0 +1,48 @@
+#version 330 core
+
+// Vertex shader of the particle transform feedback pass - this code is executed for every particle
+// Same integration as integrate_particles_scalar in particles.cpp
+
+// Inputs coming from the current state buffer, one vertex per particle
+layout (location = 0) in vec4 position_scale;         // position (xyz), scale (w)
+layout (location = 1) in vec2 angle_opacity;          // rotation of the quad in its plane (x), opacity multiplier (y)
+layout (location = 2) in vec3 velocity;
+layout (location = 3) in vec3 rotation_time_lifetime; // rotation speed (x), time lived (y), lifetime (z)
+
+// Updated particle sent to the geometry shader
+out particle_data
+{
+	vec4 position_scale;
+	vec2 angle_opacity;
+	vec3 velocity;
+	vec3 rotation_time_lifetime;
+} particle;
+
+// Coefficients of the particle type, see particle_manager::update_type_coefficients
+uniform float dt;
+uniform float z_limit;
+uniform vec3 acceleration;
+uniform vec3 damping;
+uniform float rot_damping;
+
+void main()
+{
+	float rot_speed = rotation_time_lifetime.x;
+	float time_lived = rotation_time_lifetime.y + dt;
+	float lifetime = rotation_time_lifetime.z;
+
+	// Particles above z_limit are given at most one more second to live
+	if (position_scale.z > z_limit)
+		time_lived = max(lifetime - 1.0, time_lived);
+
+	vec3 new_velocity = velocity + dt * (acceleration - damping * velocity);
+	rot_speed = rot_speed - dt * rot_damping * rot_speed;
+
+	// Particle fades out during its last second
+	float fadeout_time = 1.0;
+
+	particle.position_scale = vec4(position_scale.xyz + dt * new_velocity, position_scale.w);
+	particle.angle_opacity = vec2(angle_opacity.x + dt * rot_speed, min(lifetime - time_lived, fadeout_time) / fadeout_time);
+	particle.velocity = new_velocity;
+	particle.rotation_time_lifetime = vec3(rot_speed, time_lived, lifetime);
+}
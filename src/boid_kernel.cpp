@@ -0,0 +1,180 @@
+#include "boid_kernel.hpp"
+
+#ifdef CGP_SIMD_X86
+#include <immintrin.h>
+#endif
+
+using namespace cgp;
+
+void boid_neighbors::resize(int size)
+{
+	x.resize(size);
+	y.resize(size);
+	z.resize(size);
+	dx.resize(size);
+	dy.resize(size);
+	dz.resize(size);
+	model.resize(size);
+}
+
+void boid_neighbors::set(int index, vec3 const& position, vec3 const& direction, int modelId)
+{
+	x[index] = position.x;
+	y[index] = position.y;
+	z[index] = position.z;
+	dx[index] = direction.x;
+	dy[index] = direction.y;
+	dz[index] = direction.z;
+	model[index] = modelId;
+}
+
+boid_sums::boid_sums()
+{
+	separation = { 0, 0, 0 };
+	alignement = { 0, 0, 0 };
+	cohesion = { 0, 0, 0 };
+	separation_count = 0;
+	alignement_count = 0;
+	cohesion_count = 0;
+}
+
+void boid_accumulate_scalar(boid_neighbors const& neighbors, int begin, int end, vec3 const& position, vec3 const& direction, int modelId, float radius, boid_sums& sums)
+{
+	float const radius_sq = radius * radius;
+	for (int i = begin; i < end; i++)
+	{
+		vec3 const delta = { neighbors.x[i] - position.x, neighbors.y[i] - position.y, neighbors.z[i] - position.z };
+		float const dist_sq = dot(delta, delta);
+		if (dist_sq >= radius_sq)
+			continue;
+
+		// Separation applies to every species
+		if (dist_sq >= 1e-10f) {
+			sums.separation -= delta / dist_sq;
+			sums.separation_count++;
+		}
+
+		// Alignement and cohesion only within the same species
+		if (neighbors.model[i] != modelId)
+			continue;
+
+		vec3 const neighbor_direction = { neighbors.dx[i], neighbors.dy[i], neighbors.dz[i] };
+		vec3 const delta_direction = neighbor_direction - direction;
+		if (dot(delta_direction, delta_direction) >= 1e-6f) {
+			sums.alignement += neighbor_direction;
+			sums.alignement_count++;
+		}
+
+		sums.cohesion += vec3(neighbors.x[i], neighbors.y[i], neighbors.z[i]);
+		sums.cohesion_count++;
+	}
+}
+
+#ifdef CGP_SIMD_X86
+
+static int count_bits(int mask)
+{
+	int count = 0;
+	for (; mask != 0; mask &= mask - 1)
+		count++;
+	return count;
+}
+
+CGP_TARGET_AVX2
+static float horizontal_sum(__m256 v)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+
+/// <summary>
+/// AVX2 version of boid_accumulate_scalar, processing neighbors by packs of 8.
+/// </summary>
+/// <returns>Index of the first neighbor left for the scalar code (less than 8 remaining)</returns>
+CGP_TARGET_AVX2
+static int boid_accumulate_avx2(boid_neighbors const& neighbors, int begin, int end, vec3 const& position, vec3 const& direction, int modelId, float radius, boid_sums& sums)
+{
+	__m256 const px = _mm256_set1_ps(position.x);
+	__m256 const py = _mm256_set1_ps(position.y);
+	__m256 const pz = _mm256_set1_ps(position.z);
+	__m256 const dx = _mm256_set1_ps(direction.x);
+	__m256 const dy = _mm256_set1_ps(direction.y);
+	__m256 const dz = _mm256_set1_ps(direction.z);
+	__m256i const model = _mm256_set1_epi32(modelId);
+	__m256 const radius_sq = _mm256_set1_ps(radius * radius);
+	__m256 const min_dist_sq = _mm256_set1_ps(1e-10f);
+	__m256 const min_direction_sq = _mm256_set1_ps(1e-6f);
+	__m256 const one = _mm256_set1_ps(1.0f);
+
+	__m256 separation_x = _mm256_setzero_ps(), separation_y = _mm256_setzero_ps(), separation_z = _mm256_setzero_ps();
+	__m256 alignement_x = _mm256_setzero_ps(), alignement_y = _mm256_setzero_ps(), alignement_z = _mm256_setzero_ps();
+	__m256 cohesion_x = _mm256_setzero_ps(), cohesion_y = _mm256_setzero_ps(), cohesion_z = _mm256_setzero_ps();
+
+	int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		__m256 const x = _mm256_loadu_ps(&neighbors.x[i]);
+		__m256 const y = _mm256_loadu_ps(&neighbors.y[i]);
+		__m256 const z = _mm256_loadu_ps(&neighbors.z[i]);
+		__m256 const ex = _mm256_sub_ps(x, px);
+		__m256 const ey = _mm256_sub_ps(y, py);
+		__m256 const ez = _mm256_sub_ps(z, pz);
+		__m256 const dist_sq = _mm256_fmadd_ps(ez, ez, _mm256_fmadd_ps(ey, ey, _mm256_mul_ps(ex, ex)));
+
+		__m256 const close = _mm256_cmp_ps(dist_sq, radius_sq, _CMP_LT_OQ);
+		if (_mm256_movemask_ps(close) == 0)
+			continue;
+
+		// Separation: the masked lanes (including 1/0 for the fish itself) are zeroed
+		__m256 const separate = _mm256_and_ps(close, _mm256_cmp_ps(dist_sq, min_dist_sq, _CMP_GE_OQ));
+		__m256 const inv_dist_sq = _mm256_and_ps(separate, _mm256_div_ps(one, dist_sq));
+		separation_x = _mm256_fnmadd_ps(ex, inv_dist_sq, separation_x);
+		separation_y = _mm256_fnmadd_ps(ey, inv_dist_sq, separation_y);
+		separation_z = _mm256_fnmadd_ps(ez, inv_dist_sq, separation_z);
+		sums.separation_count += count_bits(_mm256_movemask_ps(separate));
+
+		// Cohesion
+		__m256i const neighbor_model = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(&neighbors.model[i]));
+		__m256 const same = _mm256_and_ps(close, _mm256_castsi256_ps(_mm256_cmpeq_epi32(neighbor_model, model)));
+		int const same_mask = _mm256_movemask_ps(same);
+		if (same_mask == 0)
+			continue;
+		cohesion_x = _mm256_add_ps(cohesion_x, _mm256_and_ps(same, x));
+		cohesion_y = _mm256_add_ps(cohesion_y, _mm256_and_ps(same, y));
+		cohesion_z = _mm256_add_ps(cohesion_z, _mm256_and_ps(same, z));
+		sums.cohesion_count += count_bits(same_mask);
+
+		// Alignement
+		__m256 const ndx = _mm256_loadu_ps(&neighbors.dx[i]);
+		__m256 const ndy = _mm256_loadu_ps(&neighbors.dy[i]);
+		__m256 const ndz = _mm256_loadu_ps(&neighbors.dz[i]);
+		__m256 const fx = _mm256_sub_ps(ndx, dx);
+		__m256 const fy = _mm256_sub_ps(ndy, dy);
+		__m256 const fz = _mm256_sub_ps(ndz, dz);
+		__m256 const direction_sq = _mm256_fmadd_ps(fz, fz, _mm256_fmadd_ps(fy, fy, _mm256_mul_ps(fx, fx)));
+		__m256 const align = _mm256_and_ps(same, _mm256_cmp_ps(direction_sq, min_direction_sq, _CMP_GE_OQ));
+		alignement_x = _mm256_add_ps(alignement_x, _mm256_and_ps(align, ndx));
+		alignement_y = _mm256_add_ps(alignement_y, _mm256_and_ps(align, ndy));
+		alignement_z = _mm256_add_ps(alignement_z, _mm256_and_ps(align, ndz));
+		sums.alignement_count += count_bits(_mm256_movemask_ps(align));
+	}
+
+	sums.separation += vec3(horizontal_sum(separation_x), horizontal_sum(separation_y), horizontal_sum(separation_z));
+	sums.alignement += vec3(horizontal_sum(alignement_x), horizontal_sum(alignement_y), horizontal_sum(alignement_z));
+	sums.cohesion += vec3(horizontal_sum(cohesion_x), horizontal_sum(cohesion_y), horizontal_sum(cohesion_z));
+	return i;
+}
+
+#endif
+
+void boid_accumulate(boid_neighbors const& neighbors, int begin, int end, vec3 const& position, vec3 const& direction, int modelId, float radius, boid_sums& sums)
+{
+	int scalar_begin = begin;
+#ifdef CGP_SIMD_X86
+	if (cpu_has_avx2())
+		scalar_begin = boid_accumulate_avx2(neighbors, begin, end, position, direction, modelId, radius, sums);
+#endif
+	boid_accumulate_scalar(neighbors, scalar_begin, end, position, direction, modelId, radius, sums);
+}
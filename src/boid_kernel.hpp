@@ -0,0 +1,36 @@
+#pragma once
+
+#include "cgp/cgp.hpp"
+
+/// Fish data copied in grid order, with one array per component so that consecutive neighbors can be loaded 8 at a time.
+struct boid_neighbors
+{
+	std::vector<float> x, y, z;    // Positions
+	std::vector<float> dx, dy, dz; // Directions
+	std::vector<int> model;
+
+	void resize(int size);
+
+	void set(int index, cgp::vec3 const& position, cgp::vec3 const& direction, int modelId);
+};
+
+/// Steering terms summed over the neighbors of one fish.
+struct boid_sums
+{
+	cgp::vec3 separation, alignement, cohesion;
+	int separation_count, alignement_count, cohesion_count;
+
+	boid_sums();
+};
+
+/// <summary>
+/// Adds to sums the contribution of neighbors [begin, end) to the fish at position with the given direction and species.
+///  - separation: every neighbor closer than the radius, except the fish itself
+///  - alignement: neighbors of the same species closer than the radius with a different direction
+///  - cohesion: neighbors of the same species closer than the radius
+/// Evaluates 8 neighbors per iteration when AVX2 is available at runtime, otherwise falls back to scalar code.
+/// </summary>
+void boid_accumulate(boid_neighbors const& neighbors, int begin, int end, cgp::vec3 const& position, cgp::vec3 const& direction, int modelId, float radius, boid_sums& sums);
+
+/// Same as boid_accumulate, always using the scalar code path.
+void boid_accumulate_scalar(boid_neighbors const& neighbors, int begin, int end, cgp::vec3 const& position, cgp::vec3 const& direction, int modelId, float radius, boid_sums& sums);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include "cgp/cgp.hpp"
+#include <cstdint>
+
+/// <summary>
+/// Stateless counter-based random numbers, using the Squares generator (Widynski, 2020).
+/// A value only depends on the key, an entity id and a counter (typically a tick or frame number), so any thread may draw
+/// the numbers of any entity in any order, and a simulation gives the same result whatever the number of threads.
+///
+/// Callers needing several numbers for the same entity and tick use consecutive counters, e.g. counter = tick * 4 + k.
+/// Different uses of random numbers should use generators with different seeds.
+/// </summary>
+struct counter_rng
+{
+	uint64_t key;
+
+	counter_rng(uint64_t seed = 0)
+	{
+		// The generator needs keys with well spread bits: the seed is scrambled with splitmix64
+		uint64_t z = seed + 0x9e3779b97f4a7c15ull;
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+		key = (z ^ (z >> 31)) | 1;
+	}
+
+	/// 32 random bits
+	uint32_t bits(uint32_t entity, uint32_t counter) const
+	{
+		uint64_t const y = ((uint64_t(entity) << 32) | counter) * key;
+		uint64_t const z = y + key;
+		uint64_t x = y;
+		x = x * x + y; x = (x >> 32) | (x << 32);
+		x = x * x + z; x = (x >> 32) | (x << 32);
+		x = x * x + y; x = (x >> 32) | (x << 32);
+		return uint32_t((x * x + z) >> 32);
+	}
+
+	/// Uniform in [0, 1)
+	float uniform(uint32_t entity, uint32_t counter) const
+	{
+		return (bits(entity, counter) >> 8) * (1.0f / 16777216.0f);
+	}
+
+	/// Uniform in [-1, 1)
+	float offset(uint32_t entity, uint32_t counter) const
+	{
+		return 2 * uniform(entity, counter) - 1;
+	}
+
+	/// Components uniform in [-1, 1), using the counters counter, counter + 1 and counter + 2
+	cgp::vec3 vector(uint32_t entity, uint32_t counter) const
+	{
+		return { offset(entity, counter), offset(entity, counter + 1), offset(entity, counter + 2) };
+	}
+};
@@ -0,0 +1,214 @@
+#include "gpu_particles.hpp"
+
+#include <algorithm>
+#include <cstddef>
+
+#ifndef __EMSCRIPTEN__
+
+using namespace cgp;
+
+static_assert(sizeof(gpu_particle_system::state) == 12 * sizeof(float), "The particle state must be tightly packed");
+
+static void set_attribute(GLuint location, int size, size_t offset, GLuint divisor)
+{
+	glEnableVertexAttribArray(location);
+	glVertexAttribPointer(location, size, GL_FLOAT, GL_FALSE, sizeof(gpu_particle_system::state), reinterpret_cast<void*>(offset));
+	glVertexAttribDivisor(location, divisor);
+}
+
+void gpu_particle_system::initialize(mesh_drawable const& type_drawable, int capacity_)
+{
+	capacity = capacity_;
+	count = 0;
+	current = 0;
+	in_flight = false;
+	pending_time = 0;
+	spawned.reserve(capacity);
+
+	glGenBuffers(2, buffer);
+	glGenVertexArrays(2, feedback_vao);
+	glGenQueries(1, &query);
+	for (int k = 0; k < 2; k++) {
+		glBindBuffer(GL_ARRAY_BUFFER, buffer[k]);
+		glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(capacity * sizeof(state)), nullptr, GL_DYNAMIC_COPY);
+
+		// Input of the transform feedback pass: one point per particle
+		glBindVertexArray(feedback_vao[k]);
+		set_attribute(0, 4, offsetof(state, position_scale), 0);
+		set_attribute(1, 2, offsetof(state, angle_opacity), 0);
+		set_attribute(2, 3, offsetof(state, velocity), 0);
+		set_attribute(3, 3, offsetof(state, rotation_time_lifetime), 0);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+		// The quad of the type, instanced with the particles of buffer[k]
+		drawable[k] = type_drawable;
+		drawable[k].supplementary_vbo.clear();
+		glGenVertexArrays(1, &drawable[k].vao);
+		glBindVertexArray(drawable[k].vao);
+		opengl_set_vao_location(type_drawable.vbo_position, 0);
+		opengl_set_vao_location(type_drawable.vbo_normal, 1);
+		opengl_set_vao_location(type_drawable.vbo_color, 2);
+		opengl_set_vao_location(type_drawable.vbo_uv, 3);
+		glBindBuffer(GL_ARRAY_BUFFER, buffer[k]);
+		set_attribute(4, 4, offsetof(state, position_scale), 1);
+		set_attribute(5, 2, offsetof(state, angle_opacity), 1);
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+	}
+	glBindVertexArray(0);
+	opengl_check;
+}
+
+void gpu_particle_system::clear()
+{
+	// The drawables share their buffers with the drawable of the type: only their own VAO is deleted
+	for (int k = 0; k < 2; k++) {
+		if (drawable[k].vao != 0)
+			glDeleteVertexArrays(1, &drawable[k].vao);
+		drawable[k].vao = 0;
+	}
+	if (buffer[0] != 0) {
+		glDeleteBuffers(2, buffer);
+		glDeleteVertexArrays(2, feedback_vao);
+		glDeleteQueries(1, &query);
+	}
+	buffer[0] = buffer[1] = 0;
+	feedback_vao[0] = feedback_vao[1] = 0;
+	query = 0;
+	in_flight = false;
+	pending_time = 0;
+	count = 0;
+	capacity = 0;
+	spawned.clear();
+}
+
+/// Reads the number of survivors of the pass in flight, and makes its destination the current buffer
+static void collect_pass(gpu_particle_system& system)
+{
+	GLuint survivors = 0;
+	glGetQueryObjectuiv(system.query, GL_QUERY_RESULT, &survivors);
+	system.current = 1 - system.current;
+	system.count = survivors;
+	system.in_flight = false;
+}
+
+void gpu_particle_system::step(opengl_shader_structure const& feedback_shader, float dt, float z_limit, vec3 const& acceleration, vec3 const& damping, float rot_damping)
+{
+	pending_time += dt;
+	if (in_flight) {
+		GLuint available = GL_FALSE;
+		glGetQueryObjectuiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (available == GL_FALSE)
+			return;
+		collect_pass(*this);
+	}
+
+	// Append the new particles after the survivors
+	int const upload = std::min((int)spawned.size(), capacity - count);
+	if (upload > 0) {
+		glBindBuffer(GL_ARRAY_BUFFER, buffer[current]);
+		glBufferSubData(GL_ARRAY_BUFFER, GLintptr(count * sizeof(state)), GLsizeiptr(upload * sizeof(state)), spawned.data());
+		glBindBuffer(GL_ARRAY_BUFFER, 0);
+		count += upload;
+	}
+	spawned.clear();
+
+	// Time without particles is not kept for the next ones
+	if (count == 0)
+		pending_time = 0;
+	if (count > 0 && pending_time > 0)
+	{
+		glUseProgram(feedback_shader.id);
+		opengl_uniform(feedback_shader, "dt", pending_time);
+		opengl_uniform(feedback_shader, "z_limit", z_limit);
+		opengl_uniform(feedback_shader, "acceleration", acceleration);
+		opengl_uniform(feedback_shader, "damping", damping);
+		opengl_uniform(feedback_shader, "rot_damping", rot_damping);
+
+		// Points are only integrated, nothing is rasterized
+		glEnable(GL_RASTERIZER_DISCARD);
+		glBindVertexArray(feedback_vao[current]);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffer[1 - current]);
+		glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, query);
+		glBeginTransformFeedback(GL_POINTS);
+		glDrawArrays(GL_POINTS, 0, count);
+		glEndTransformFeedback();
+		glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+		glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+		glBindVertexArray(0);
+		glDisable(GL_RASTERIZER_DISCARD);
+		glUseProgram(0);
+
+		in_flight = true;
+		pending_time = 0;
+	}
+	opengl_check;
+}
+
+void gpu_particle_system::synchronize()
+{
+	if (in_flight)
+		collect_pass(*this);
+}
+
+void gpu_particle_system::draw(environment_structure const& environment, rotation_transform const& orientation, float scale)
+{
+	if (count == 0)
+		return;
+	mesh_drawable& instanced = drawable[current];
+	instanced.model.rotation = orientation;
+	instanced.model.scaling = scale;
+	cgp::draw(instanced, environment, count);
+}
+
+static GLuint compile_shader(GLenum type, std::string const& path)
+{
+	std::string const source = read_text_file(path);
+	char const* text = source.c_str();
+	GLuint const shader = glCreateShader(type);
+	glShaderSource(shader, 1, &text, nullptr);
+	glCompileShader(shader);
+
+	GLint compiled = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (compiled == GL_FALSE) {
+		GLint length = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+		std::string log(std::max(length, 1), '\0');
+		glGetShaderInfoLog(shader, length, nullptr, &log[0]);
+		error_cgp("Cannot compile " + path + "\n" + log);
+	}
+	return shader;
+}
+
+opengl_shader_structure load_particle_feedback_shader(std::string const& vertex_shader_path, std::string const& geometry_shader_path)
+{
+	GLuint const vertex_shader = compile_shader(GL_VERTEX_SHADER, vertex_shader_path);
+	GLuint const geometry_shader = compile_shader(GL_GEOMETRY_SHADER, geometry_shader_path);
+
+	opengl_shader_structure shader;
+	shader.id = glCreateProgram();
+	glAttachShader(shader.id, vertex_shader);
+	glAttachShader(shader.id, geometry_shader);
+
+	// The captured outputs must be declared before linking, in the order of gpu_particle_system::state
+	char const* varyings[] = { "out_position_scale", "out_angle_opacity", "out_velocity", "out_rotation_time_lifetime" };
+	glTransformFeedbackVaryings(shader.id, 4, varyings, GL_INTERLEAVED_ATTRIBS);
+	glLinkProgram(shader.id);
+
+	GLint linked = 0;
+	glGetProgramiv(shader.id, GL_LINK_STATUS, &linked);
+	if (linked == GL_FALSE) {
+		GLint length = 0;
+		glGetProgramiv(shader.id, GL_INFO_LOG_LENGTH, &length);
+		std::string log(std::max(length, 1), '\0');
+		glGetProgramInfoLog(shader.id, length, nullptr, &log[0]);
+		error_cgp("Cannot link the particle transform feedback program\n" + log);
+	}
+
+	glDeleteShader(vertex_shader);
+	glDeleteShader(geometry_shader);
+	opengl_check;
+	return shader;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "cgp/cgp.hpp"
+#include "environment.hpp"
+
+// Geometry shaders are not available with OpenGL ES: the GPU simulation is only on desktop
+#ifndef __EMSCRIPTEN__
+
+/// <summary>
+/// Particles of one type simulated on the GPU with transform feedback (OpenGL 3.3 core).
+///
+/// The state lives in two buffers used in turn as source and destination: each step draws the particles of the source buffer
+/// as points, the vertex shader integrates them like integrate_particles_scalar, and the geometry shader only writes the
+/// surviving ones into the destination buffer, in the same order. The CPU only uploads the particles spawned since the
+/// previous step, appended after the survivors, and the instanced draw reads its per-instance attributes directly from the state buffer.
+///
+/// The number of survivors is only known once the pass is done (OpenGL 3.3 has no glDrawTransformFeedback). It is not waited for:
+/// while the pass is in flight, its source buffer is drawn and the elapsed time is kept for the next pass. So the drawn particles
+/// are one step behind the simulation.
+/// </summary>
+struct gpu_particle_system
+{
+	/// Interleaved state of a particle. The first 6 floats are the per-instance attributes of shaders/particle/vert.glsl.
+	struct state {
+		cgp::vec4 position_scale;
+		cgp::vec2 angle_opacity;
+		cgp::vec3 velocity;
+		cgp::vec3 rotation_time_lifetime; // Rotation speed, time lived and lifetime
+	};
+
+	GLuint buffer[2] = { 0, 0 };
+	GLuint feedback_vao[2] = { 0, 0 }; // Reads buffer[k] as the input of the transform feedback pass
+	cgp::mesh_drawable drawable[2];    // Copies of the drawable of the type, whose instances are read from buffer[k]
+	GLuint query = 0;
+	bool in_flight = false; // A pass from buffer[current] to the other buffer is running, its query is not read yet
+	float pending_time = 0; // Elapsed time not integrated yet
+	int current = 0;  // Buffer holding the live particles
+	int count = 0;    // Number of live particles in buffer[current]
+	int capacity = 0;
+	std::vector<state> spawned; // Uploaded at the next step
+
+	void initialize(cgp::mesh_drawable const& type_drawable, int capacity_);
+
+	void clear();
+
+	/// Appends the spawned particles after the live ones, then starts integrating them during the time elapsed since the last pass,
+	/// with the coefficients of their type. Does nothing but accumulate dt while the previous pass is in flight.
+	void step(cgp::opengl_shader_structure const& feedback_shader, float dt, float z_limit, cgp::vec3 const& acceleration, cgp::vec3 const& damping, float rot_damping);
+
+	/// Waits for the pass in flight, so that buffer[current] holds the latest state. Blocks the CPU: meant for tools and tests.
+	void synchronize();
+
+	void draw(environment_structure const& environment, cgp::rotation_transform const& orientation, float scale);
+};
+
+/// Loads the transform feedback program (vertex and geometry shaders) shared by every particle type
+cgp::opengl_shader_structure load_particle_feedback_shader(std::string const& vertex_shader_path, std::string const& geometry_shader_path);
+
+#endif
@@ -0,0 +1,193 @@
+#include "chunked_terrain.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+using namespace cgp;
+
+chunked_terrain_structure::~chunked_terrain_structure()
+{
+	// The jobs write into the chunks: they must be done before the chunks are freed. The GPU buffers are left to the context.
+	for (auto& entry : chunks)
+		if (entry.second->job != nullptr)
+			workers->wait(entry.second->job);
+}
+
+uint64_t chunked_terrain_structure::chunk_key(int2 const& coordinates)
+{
+	return (uint64_t(uint32_t(coordinates.x)) << 32) | uint32_t(coordinates.y);
+}
+
+void chunked_terrain_structure::reset(field_function_structure const& field_function_, float resolution_, float isovalue_)
+{
+	clear();
+	field_function = field_function_;
+	resolution = resolution_;
+	isovalue = isovalue_;
+}
+
+void chunked_terrain_structure::clear()
+{
+	for (auto& entry : chunks) {
+		terrain_chunk& chunk = *entry.second;
+		if (chunk.job != nullptr)
+			workers->wait(chunk.job);
+		if (chunk.shape.vao != 0)
+			chunk.shape.clear();
+	}
+	chunks.clear();
+}
+
+/// Samples [0, dimension) of grid, which must be at least as large
+template <typename T>
+static grid_3D<T> crop_grid(grid_3D<T> const& grid, int3 const& dimension)
+{
+	grid_3D<T> cropped(dimension);
+	for (int kz = 0; kz < dimension.z; kz++)
+		for (int ky = 0; ky < dimension.y; ky++)
+			for (int kx = 0; kx < dimension.x; kx++)
+				cropped.at_unsafe(kx, ky, kz) = grid.at_unsafe(kx, ky, kz);
+	return cropped;
+}
+
+void chunked_terrain_structure::generate_chunk(terrain_chunk& chunk, field_function_structure const& field_function, float chunk_length, float resolution, float ground_level, float height, float isovalue)
+{
+	// Neighboring chunks share their border samples, so that their meshes join without cracks
+	int const cubes_xy = std::max(1, (int)std::round(chunk_length / resolution));
+	int const cubes_z = std::max(1, (int)std::round(height / resolution));
+	vec3 const length = { chunk_length, chunk_length, height };
+	vec3 const corner = { chunk.coordinates.x * chunk_length, chunk.coordinates.y * chunk_length, ground_level };
+	int3 const samples = { cubes_xy + 1, cubes_xy + 1, cubes_z + 1 };
+
+	// The gradient is a forward difference, except on the last sample of the grid. The field is therefore sampled one voxel
+	// past the +x, +y and +z borders, so that the shared border samples get the same gradient, hence the same normal, in both chunks.
+	vec3 const voxel = { chunk_length / cubes_xy, chunk_length / cubes_xy, height / cubes_z };
+	spatial_domain_grid_3D const extended = spatial_domain_grid_3D::from_corners(corner, corner + length + voxel, samples + int3(1, 1, 1));
+	grid_3D<float> const extended_field = compute_discrete_scalar_field(extended, field_function);
+
+	// Only the cubes of the chunk are meshed
+	implicit_surface_field_structure field;
+	field.domain = spatial_domain_grid_3D::from_corners(corner, corner + length, samples);
+	field.field = crop_grid(extended_field, samples);
+	field.gradient = crop_grid(compute_gradient(extended_field), samples);
+
+	compute_marching_cube(chunk.data, field, isovalue);
+	chunk.data.relative.clear();
+	chunk.data.relative.shrink_to_fit();
+}
+
+void chunked_terrain_structure::update(vec3 const& camera_position)
+{
+	frame++;
+
+	// Chunks within the view distance, nearest first. Beyond max_chunks, the furthest ones are ignored, otherwise they would evict each other.
+	int const radius = (int)std::ceil(view_distance / chunk_length);
+	int2 const camera_chunk = { (int)std::floor(camera_position.x / chunk_length), (int)std::floor(camera_position.y / chunk_length) };
+	std::vector<std::pair<float, int2>> visible;
+	for (int dy = -radius; dy <= radius; dy++) {
+		for (int dx = -radius; dx <= radius; dx++) {
+			int2 const coordinates = { camera_chunk.x + dx, camera_chunk.y + dy };
+
+			// Distance from the camera to the closest point of the chunk in the horizontal plane
+			float const x = std::max({ coordinates.x * chunk_length - camera_position.x, camera_position.x - (coordinates.x + 1) * chunk_length, 0.0f });
+			float const y = std::max({ coordinates.y * chunk_length - camera_position.y, camera_position.y - (coordinates.y + 1) * chunk_length, 0.0f });
+			float const distance = std::sqrt(x * x + y * y);
+			if (distance <= view_distance)
+				visible.push_back({ distance, coordinates });
+		}
+	}
+	std::sort(visible.begin(), visible.end(), [](std::pair<float, int2> const& a, std::pair<float, int2> const& b) { return a.first < b.first; });
+	if ((int)visible.size() > max_chunks)
+		visible.resize(std::max(0, max_chunks));
+
+	// Collect the generated chunks, including the ones that left the view distance meanwhile
+	for (auto& entry : chunks) {
+		terrain_chunk& chunk = *entry.second;
+		if (chunk.job != nullptr && workers->finished(chunk.job))
+			chunk.job = nullptr;
+	}
+
+	// Request the missing chunks, and send the generated ones to the GPU.
+	// Without workers, the chunks are generated here, still at most max_pending per frame.
+	int pending = pending_chunks();
+	int uploads = 0;
+	for (auto const& entry : visible) {
+		uint64_t const key = chunk_key(entry.second);
+		auto it = chunks.find(key);
+		if (it == chunks.end()) {
+			if (pending >= max_pending)
+				continue;
+
+			std::unique_ptr<terrain_chunk> created(new terrain_chunk());
+			terrain_chunk* chunk = created.get();
+			chunk->coordinates = entry.second;
+			it = chunks.emplace(key, std::move(created)).first;
+
+			if (workers != nullptr) {
+				field_function_structure const function = field_function;
+				float const chunk_length_ = chunk_length, resolution_ = resolution, ground_level_ = ground_level, height_ = height, isovalue_ = isovalue;
+				chunk->job = workers->submit(1, [=](int) {
+					generate_chunk(*chunk, function, chunk_length_, resolution_, ground_level_, height_, isovalue_);
+				});
+			}
+			else
+				generate_chunk(*chunk, field_function, chunk_length, resolution, ground_level, height, isovalue);
+			pending++;
+		}
+
+		terrain_chunk& chunk = *it->second;
+		chunk.last_used = frame;
+		if (chunk.job == nullptr && !chunk.uploaded && uploads < max_uploads) {
+			if (chunk.data.number_of_vertex > 0)
+				initialize_surface_drawable(chunk.shape, chunk.data, appearance);
+			chunk.data = implicit_surface_data();
+			chunk.uploaded = true;
+			uploads++;
+		}
+	}
+
+	// Release the least recently used chunks, except the ones being generated
+	while ((int)chunks.size() > max_chunks) {
+		auto oldest = chunks.end();
+		for (auto it = chunks.begin(); it != chunks.end(); ++it) {
+			terrain_chunk const& chunk = *it->second;
+			if (chunk.job == nullptr && (oldest == chunks.end() || chunk.last_used < oldest->second->last_used))
+				oldest = it;
+		}
+		if (oldest == chunks.end())
+			break;
+
+		terrain_chunk& chunk = *oldest->second;
+		if (chunk.shape.vao != 0)
+			chunk.shape.clear();
+		chunks.erase(oldest);
+	}
+}
+
+void chunked_terrain_structure::draw(environment_structure const& environment) const
+{
+	for (auto const& entry : chunks) {
+		terrain_chunk const& chunk = *entry.second;
+		if (chunk.shape.vao != 0 && chunk.last_used == frame)
+			cgp::draw(chunk.shape, environment);
+	}
+}
+
+int chunked_terrain_structure::pending_chunks() const
+{
+	int pending = 0;
+	for (auto const& entry : chunks)
+		if (entry.second->job != nullptr)
+			pending++;
+	return pending;
+}
+
+int chunked_terrain_structure::uploaded_chunks() const
+{
+	int uploaded = 0;
+	for (auto const& entry : chunks)
+		if (entry.second->shape.vao != 0)
+			uploaded++;
+	return uploaded;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "cgp/cgp.hpp"
+#include "implicit_surface.hpp"
+#include "thread_pool.hpp"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+/// <summary>
+/// Square column of terrain, with its own field, marching cube mesh and GPU buffers.
+/// The field is only kept while the mesh is computed, and the mesh until it is sent to the GPU.
+/// </summary>
+struct terrain_chunk
+{
+	cgp::int2 coordinates;           // The chunk covers [x, x+1] * chunk_length along x, same along y
+	implicit_surface_data data;      // Mesh computed by the generation job
+	cgp::mesh_drawable shape;
+	thread_pool::job job;            // Generation of the field and of the mesh
+	bool uploaded = false;           // Sent to the GPU, or found empty
+	int last_used = 0;               // Last frame the chunk was within the view distance
+};
+
+/// <summary>
+/// Seabed streamed around the camera. The chunks within view_distance are generated on the workers, nearest first,
+/// and sent to the GPU by update() once ready. When more than max_chunks are loaded, the least recently used ones are released,
+/// so the terrain has no bound while the memory stays bounded.
+/// </summary>
+struct chunked_terrain_structure
+{
+	float chunk_length = 250.0f;
+	float view_distance = 1500.0f;
+	int max_chunks = 160;     // Chunks kept in memory, visible or not
+	int max_pending = 2;      // Chunks generated at the same time, to leave workers for the simulations
+	int max_uploads = 2;      // Chunks sent to the GPU per frame
+
+	// Generation parameters, copied by the jobs
+	field_function_structure field_function;
+	float resolution = 4.0f;  // Length of a voxel
+	float ground_level = 0.0f;
+	float height = 0.0f;      // The chunks cover [ground_level, ground_level + height] along z
+	float isovalue = 0.0f;
+
+	thread_pool* workers = nullptr;
+	cgp::mesh_drawable appearance; // Shader, textures and material of the chunks
+
+	std::unordered_map<uint64_t, std::unique_ptr<terrain_chunk>> chunks; // Keyed by chunk_key
+	int frame = 0;
+
+	~chunked_terrain_structure();
+
+	/// Sets the generation parameters, and releases the chunks generated with the previous ones
+	void reset(field_function_structure const& field_function_, float resolution_, float isovalue_);
+
+	/// Requests the chunks around the camera, sends the generated ones to the GPU and releases the least recently used ones
+	void update(cgp::vec3 const& camera_position);
+
+	/// Draws the chunks within the view distance
+	void draw(environment_structure const& environment) const;
+
+	/// Waits for the pending jobs and releases every chunk
+	void clear();
+
+	/// Chunks whose generation was requested and not yet collected by update()
+	int pending_chunks() const;
+
+	int uploaded_chunks() const;
+
+	static uint64_t chunk_key(cgp::int2 const& coordinates);
+
+	/// Computes the field, its gradient and the mesh of a chunk (run by the workers)
+	static void generate_chunk(terrain_chunk& chunk, field_function_structure const& field_function, float chunk_length, float resolution, float ground_level, float height, float isovalue);
+};
@@ -56,6 +56,20 @@ float perlin_noise_params::compute(cgp::vec2 const& pos, float time) const
     return noise_perlin({ pos.x * scale, pos.y * scale }, octave, persistency, frequency_gain) * multiplier - offset;
 }
 
+void perlin_noise_params::compute(float const* x, float const* y, float const* z, int count, float* value) const
+{
+    noise_perlin_batch(x, y, z, count, value, octave, persistency, frequency_gain, scale);
+    for (int k = 0; k < count; k++)
+        value[k] = value[k] * multiplier - offset;
+}
+
+void perlin_noise_params::compute(float const* x, float const* y, int count, float* value) const
+{
+    noise_perlin_batch(x, y, count, value, octave, persistency, frequency_gain, scale);
+    for (int k = 0; k < count; k++)
+        value[k] = value[k] * multiplier - offset;
+}
+
 field_function_structure::field_function_structure() {
     floor_att_dist = 2.0f;
     floor_1_level = -200.0f;
@@ -116,25 +130,50 @@ cgp::vec3 field_function_structure::color_at(const vec3& pos) const {
 }*/
 
 /// <summary>
-/// Formula to compute terrain potential (implicit surface) at a specific location
+/// Combines the floor and cave noises at a given height into the terrain potential
 /// </summary>
-/// <param name="pos"></param>
-/// <returns></returns>
-float field_function_structure::operator()(cgp::vec3 const& pos) const
+static float terrain_potential(field_function_structure const& field, float z, float floor_noise, float cave_noise)
 {
     float pot = 0.0f;
 
     // Bottom hills
-    float const height = pos.z - ground_level;
-    float const floor_pot = floor_perlin.compute(vec2(pos.x, pos.y)) * exp(-height / floor_att_dist);
+    float const height = z - field.ground_level;
+    float const floor_pot = floor_noise * exp(-height / field.floor_att_dist);
     pot += floor_pot;
     
     // Add caves
-    bool const low = pos.z < floor_1_level;
-    float const cave_height = floor_1_level - ground_level;
-    float const mult = (0.5f + 0.6f * height / cave_height) * (low ? 1.0f : 0.9f * exp(-(pos.z - floor_1_level) * 2.0f));
-    float const cave_pot = mult * cave_perlin.compute(pos);
+    bool const low = z < field.floor_1_level;
+    float const cave_height = field.floor_1_level - field.ground_level;
+    float const mult = (0.5f + 0.6f * height / cave_height) * (low ? 1.0f : 0.9f * exp(-(z - field.floor_1_level) * 2.0f));
+    float const cave_pot = mult * cave_noise;
     pot += cave_pot;
     
     return pot;
 }
+
+/// <summary>
+/// Formula to compute terrain potential (implicit surface) at a specific location
+/// </summary>
+/// <param name="pos"></param>
+/// <returns></returns>
+float field_function_structure::operator()(cgp::vec3 const& pos) const
+{
+    return terrain_potential(*this, pos.z, floor_perlin.compute(vec2(pos.x, pos.y)), cave_perlin.compute(pos));
+}
+
+/// <summary>
+/// Batched version of the terrain potential: the noises of up to 64 points are computed at once, then combined
+/// </summary>
+void field_function_structure::operator()(float const* x, float const* y, float const* z, int count, float* value) const
+{
+    int const chunk = 64;
+    float floor_noise[chunk];
+    float cave_noise[chunk];
+    for (int begin = 0; begin < count; begin += chunk) {
+        int const n = std::min(chunk, count - begin);
+        floor_perlin.compute(x + begin, y + begin, n, floor_noise);
+        cave_perlin.compute(x + begin, y + begin, z + begin, n, cave_noise);
+        for (int k = 0; k < n; k++)
+            value[begin + k] = terrain_potential(*this, z[begin + k], floor_noise[k], cave_noise[k]);
+    }
+}
\ No newline at end of file
@@ -27,6 +27,11 @@ struct perlin_noise_params
 	float compute(cgp::vec2 const& pos) const;
 
 	float compute(cgp::vec2 const& pos, float time) const;
+
+	// Batched versions over count points given as arrays of coordinates, see cgp::noise_perlin_batch
+	void compute(float const* x, float const* y, float const* z, int count, float* value) const;
+
+	void compute(float const* x, float const* y, int count, float* value) const;
 };
 
 // Parametric function defined as a sum of blobs-like primitives
@@ -40,6 +45,9 @@ struct field_function_structure {
 	// Query the value of the function at any point p
 	float operator()(cgp::vec3 const& p) const;
 
+	// Query the values of the function at count points given as arrays of coordinates, the noises being computed several points at a time
+	void operator()(float const* x, float const* y, float const* z, int count, float* value) const;
+
 	// Query color of terrain at any point p
 	//cgp::vec3 uv_at(cgp::vec3 const& pos) const;
 
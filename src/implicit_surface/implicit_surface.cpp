@@ -32,82 +32,132 @@ static void update_uvs(std::vector<vec3>& uv, int number_of_vertex, std::vector<
 	}
 }*/
 
-void implicit_surface_structure::update_marching_cube(field_function_structure const& field_function, float isovalue)
+void compute_marching_cube(implicit_surface_data& data, implicit_surface_field_structure const& field, float isovalue, thread_pool* workers)
 {
-	// Variable shortcut
-	std::vector<vec3>& position = data_param.position;
-	std::vector<vec3>& normal = data_param.normal;
-	//std::vector<vec3>& color = data_param.color;
-	//std::vector<vec3>& uv = data_param.normal;
-
-	size_t& number_of_vertex = data_param.number_of_vertex;
-	spatial_domain_grid_3D const& domain = field_param.domain;
-	std::vector<cgp::marching_cube_relative_coordinates> relative_coord = data_param.relative;
-	grid_3D<float> const& field = field_param.field;
-	grid_3D<vec3> const& gradient = field_param.gradient;
-
-	// Store the size of the previous position buffer
-	size_t const previous_size = position.size();
-
-	// Compute the Marching Cube
-	number_of_vertex = marching_cube(position, field.data.data, domain, isovalue, &relative_coord);
-
-	// Resize vectors if needed
-	if (normal.size() < position.size()) {
-		normal.resize(position.size());
-		//color.resize(position.size());
+	// Compute the Marching Cube, the slabs of cubes being shared between the workers if any
+	if (workers != nullptr) {
+		int const slab_number = std::min(field.domain.samples.z - 1, 4 * workers->size());
+		marching_cube_indexed(data.position, data.connectivity, field.field.data.data, field.domain, isovalue, &data.relative, slab_number,
+			[workers](int task_count, std::function<void(int)> const& task) { workers->run(task_count, task); });
 	}
+	else
+		marching_cube_indexed(data.position, data.connectivity, field.field.data.data, field.domain, isovalue, &data.relative);
+	data.number_of_vertex = data.position.size();
+
+	data.normal.resize(data.number_of_vertex);
+	update_normals(data.normal, data.number_of_vertex, field.gradient, data.relative);
+}
 
-	update_normals(normal, number_of_vertex, gradient, relative_coord);
+mesh implicit_surface_mesh(implicit_surface_data const& data)
+{
+	mesh m;
+	m.position = data.position;
+	m.normal = data.normal;
+	m.connectivity = data.connectivity;
+	m.fill_empty_field();
+	return m;
+}
+
+void initialize_surface_drawable(mesh_drawable& shape, implicit_surface_data const& data, mesh_drawable const& appearance)
+{
+	// clear() also resets the appearance, hence the copy
+	mesh_drawable const style = appearance;
+	shape.clear();
+	if (data.number_of_vertex > 0)
+		shape.initialize_data_on_gpu(implicit_surface_mesh(data), style.shader, style.texture);
+
+	shape.shader = style.shader;
+	shape.texture = style.texture;
+	shape.supplementary_texture = style.supplementary_texture;
+	shape.material = style.material;
+}
+
+void implicit_surface_structure::update_marching_cube(field_function_structure const& field_function, float isovalue)
+{
+	compute_marching_cube(data_param, field_param, isovalue, workers);
 	//update_colors(color, number_of_vertex, position, field_function);
 	//update_uvs(normal, number_of_vertex, position, field_function);
 
-	// Update the display of the mesh
-	if (position.size() > previous_size) {
-		// If there is more position than allocated - perform a full clear and reallocation from scratch
-		drawable_param.shape.clear();
-		drawable_param.shape.initialize_data_on_gpu(position, normal);
-	}
-	else {
-		// Otherwise simply update the new relevant values re-using the allocated buffers
-		drawable_param.shape.vbo_position.update(position, number_of_vertex);
-		drawable_param.shape.vbo_normal.update(normal, number_of_vertex);
-		//drawable_param.shape.vbo_color.update(color, number_of_vertex);
-		drawable_param.shape.vertex_number = number_of_vertex;
-	}
-
+	// Update the display of the mesh, the number of triangles changing with the isovalue
 	drawable_param.shape.shader = shader;
+	initialize_surface_drawable(drawable_param.shape, data_param, drawable_param.shape);
 }
 
 
+implicit_surface_structure::~implicit_surface_structure()
+{
+	// The job writes into pending_field
+	if (field_job != nullptr)
+		workers->wait(field_job);
+}
+
 void implicit_surface_structure::update_field(field_function_structure const& field_function, float isovalue)
 {
+	// Computed on the workers, the previous field is kept meanwhile
+	if (!build_mesh && workers != nullptr) {
+		pending_function = field_function;
+		field_requested = true;
+		if (field_job == nullptr)
+			start_field_job();
+		return;
+	}
+
 	// Variable shortcut
 	grid_3D<float>& field = field_param.field;
 	grid_3D<vec3>& gradient = field_param.gradient;
-	spatial_domain_grid_3D& domain = field_param.domain;
+	field_param.domain = domain;
 
 	// Compute the scalar field
-	field = compute_discrete_scalar_field(domain, field_function);
+	field = compute_discrete_scalar_field(domain, field_function, workers);
 
 	// Compute the gradient of the scalar field
 	gradient = compute_gradient(field);
 
 	// Recompute the marching cube
-	update_marching_cube(field_function, isovalue);
+	if (build_mesh)
+		update_marching_cube(field_function, isovalue);
 
 	// Reset the domain visualization (lightweight - can be cleared at each call)
 	drawable_param.domain_box.clear();
 	drawable_param.domain_box.initialize_data_on_gpu(domain.export_segments_for_drawable_border());
 }
 
+void implicit_surface_structure::start_field_job()
+{
+	field_requested = false;
+	pending_field.domain = domain;
+	implicit_surface_field_structure* const target = &pending_field;
+	field_function_structure const function = pending_function;
+	thread_pool* const pool = workers;
+	field_job = workers->submit(1, [=](int) {
+		target->field = compute_discrete_scalar_field(target->domain, function, pool);
+		target->gradient = compute_gradient(target->field);
+	});
+}
+
+bool implicit_surface_structure::collect_field()
+{
+	if (field_job == nullptr || !workers->finished(field_job))
+		return false;
+	field_job = nullptr;
+	std::swap(field_param, pending_field);
+
+	drawable_param.domain_box.clear();
+	drawable_param.domain_box.initialize_data_on_gpu(field_param.domain.export_segments_for_drawable_border());
+
+	// The parameters changed while the field was computed
+	if (field_requested)
+		start_field_job();
+	return true;
+}
+
 int3 to_int3(vec3 const& vec) {
 	return int3((int)vec.x, (int)vec.y, (int)vec.z);
 }
 
 void implicit_surface_structure::set_domain(float const& resolution, cgp::vec3 const& length)
 {
-	field_param.domain = spatial_domain_grid_3D::from_center_length({ 0, 0, length.z / 2.0f + ground_level }, length, to_int3(length / resolution));
+	domain = spatial_domain_grid_3D::from_center_length({ 0, 0, length.z / 2.0f + ground_level }, length, to_int3(length / resolution));
 }
 
 void implicit_surface_structure::display_gui_implicit_surface(bool& is_update_field, bool& is_update_marching_cube, bool& is_save_obj, environment_structure& gui, field_function_structure& field_function)
@@ -140,7 +190,7 @@ void implicit_surface_structure::display_gui_implicit_surface(bool& is_update_fi
 	}
 }
 
-void implicit_surface_structure::gui_update(environment_structure& gui, field_function_structure& field_function)
+bool implicit_surface_structure::gui_update(environment_structure& gui, field_function_structure& field_function)
 {
 	bool is_update_marching_cube = false;
 	bool is_update_field = false;
@@ -148,7 +198,7 @@ void implicit_surface_structure::gui_update(environment_structure& gui, field_fu
 
 	display_gui_implicit_surface(is_update_field, is_update_marching_cube, is_save_obj, gui, field_function);
 
-	if (is_update_marching_cube) 
+	if (is_update_marching_cube && build_mesh)
 		update_marching_cube(field_function, gui.isovalue);
 	if (is_update_field) {
 		set_domain(gui.domain.resolution, gui.domain.length);
@@ -156,28 +206,89 @@ void implicit_surface_structure::gui_update(environment_structure& gui, field_fu
 	}
 
 	if (is_save_obj) {
-		data_param.position.resize(data_param.number_of_vertex);
-		data_param.normal.resize(data_param.number_of_vertex);
-		save_file_obj("mesh.obj", data_param.position, data_param.normal);
+		if (!build_mesh)
+			compute_marching_cube(data_param, field_param, gui.isovalue, workers);
+		if (data_param.number_of_vertex > 0)
+			save_file_obj("mesh.obj", implicit_surface_mesh(data_param));
 	}
+
+	return is_update_field || is_update_marching_cube;
 }
 
-grid_3D<float> compute_discrete_scalar_field(spatial_domain_grid_3D const& domain, field_function_structure const& func)
+// Trilinear interpolation of a grid sampling the domain, positions outside of the domain are clamped to its border
+template <typename T>
+static T sample_trilinear(grid_3D<T> const& grid, spatial_domain_grid_3D const& domain, vec3 const& p)
 {
-	grid_3D<float> field;
-	field.resize(domain.samples);
+	vec3 const corner = domain.corner_min();
+	vec3 const voxel = domain.voxel_length();
+	int3 const& N = grid.dimension;
+
+	float const x = std::min(std::max((p.x - corner.x) / voxel.x, 0.0f), N.x - 1.0f);
+	float const y = std::min(std::max((p.y - corner.y) / voxel.y, 0.0f), N.y - 1.0f);
+	float const z = std::min(std::max((p.z - corner.z) / voxel.z, 0.0f), N.z - 1.0f);
+	int const kx = std::min((int)x, N.x - 2);
+	int const ky = std::min((int)y, N.y - 2);
+	int const kz = std::min((int)z, N.z - 2);
+	float const ax = x - kx;
+	float const ay = y - ky;
+	float const az = z - kz;
+
+	T const v00 = (1 - ax) * grid.at_unsafe(kx, ky, kz) + ax * grid.at_unsafe(kx + 1, ky, kz);
+	T const v10 = (1 - ax) * grid.at_unsafe(kx, ky + 1, kz) + ax * grid.at_unsafe(kx + 1, ky + 1, kz);
+	T const v01 = (1 - ax) * grid.at_unsafe(kx, ky, kz + 1) + ax * grid.at_unsafe(kx + 1, ky, kz + 1);
+	T const v11 = (1 - ax) * grid.at_unsafe(kx, ky + 1, kz + 1) + ax * grid.at_unsafe(kx + 1, ky + 1, kz + 1);
+
+	T const v0 = (1 - ay) * v00 + ay * v10;
+	T const v1 = (1 - ay) * v01 + ay * v11;
+	return (1 - az) * v0 + az * v1;
+}
 
-	// Fill the discrete field values
-	for (int kz = 0; kz < domain.samples.z; kz++) {
-		for (int ky = 0; ky < domain.samples.y; ky++) {
-			for (int kx = 0; kx < domain.samples.x; kx++) {
+float implicit_surface_field_structure::sample(vec3 const& p) const
+{
+	return sample_trilinear(field, domain, p);
+}
+
+vec3 implicit_surface_field_structure::sample_gradient(vec3 const& p) const
+{
+	// The discrete gradient stores differences between neighboring voxels
+	vec3 const voxel = domain.voxel_length();
+	vec3 const g = sample_trilinear(gradient, domain, p);
+	return { g.x / voxel.x, g.y / voxel.y, g.z / voxel.z };
+}
 
-				vec3 const p = domain.position({ kx, ky, kz });
-				field(kx, ky, kz) = func(p);
+grid_3D<float> compute_discrete_scalar_field(spatial_domain_grid_3D const& domain, field_function_structure const& func, thread_pool* workers)
+{
+	grid_3D<float> field;
+	field.resize(domain.samples);
 
+	// Tasks are ranges of consecutive z-slabs, several per thread so that the cost of the caves (which vary with z) is balanced
+	int const Nz = domain.samples.z;
+	int const task_number = workers != nullptr ? std::min(Nz, 4 * workers->size()) : 1;
+	auto const fill_slabs = [&](int task) {
+		int const z_begin = (int)((long long)task * Nz / task_number);
+		int const z_end = (int)((long long)(task + 1) * Nz / task_number);
+
+		// Fill the discrete field values, one row along x at a time so that the noise is computed for several voxels at once.
+		// The rows share the same x coordinates, and each row has constant y and z coordinates.
+		int const Nx = domain.samples.x;
+		std::vector<float> x(Nx), y(Nx), z(Nx);
+		for (int kx = 0; kx < Nx; kx++)
+			x[kx] = domain.position({ kx, 0, 0 }).x;
+
+		for (int kz = z_begin; kz < z_end; kz++) {
+			for (int ky = 0; ky < domain.samples.y; ky++) {
+				vec3 const p = domain.position({ 0, ky, kz });
+				std::fill(y.begin(), y.end(), p.y);
+				std::fill(z.begin(), z.end(), p.z);
+				func(x.data(), y.data(), z.data(), Nx, &field.at_unsafe(0, ky, kz));
 			}
 		}
-	}
+	};
+
+	if (workers != nullptr)
+		workers->run(task_number, fill_slabs);
+	else
+		fill_slabs(0);
 
 	return field;
 }
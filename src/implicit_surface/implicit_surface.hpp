@@ -3,6 +3,7 @@
 #include "cgp/cgp.hpp"
 #include "field_function.hpp"
 #include "environment.hpp"
+#include "thread_pool.hpp"
 
 
 
@@ -14,13 +15,21 @@ struct implicit_surface_field_structure {
 	cgp::spatial_domain_grid_3D domain;   // The domain where the discrete field is defined
 	cgp::grid_3D<float> field;            // The grid storing the value of the field
 	cgp::grid_3D<cgp::vec3> gradient;     // The discrete gradient of the field
+
+	// Trilinear interpolation of the stored field at any position, a few memory reads instead of evaluating the field function.
+	// Positions outside of the domain are clamped to its border.
+	float sample(cgp::vec3 const& p) const;
+
+	// Same for the gradient, expressed per unit of length
+	cgp::vec3 sample_gradient(cgp::vec3 const& p) const;
 };
 
 // Sub-structure that contains the data of the surface
 struct implicit_surface_data {
 	size_t number_of_vertex;              // The valid number of vertex of the surface
-	std::vector<cgp::vec3> position;      // Positions of the mesh
+	std::vector<cgp::vec3> position;      // Positions of the mesh, one per intersected edge of the grid
 	std::vector<cgp::vec3> normal;        // Normals of the mesh
+	std::vector<cgp::uint3> connectivity; // Triangles of the mesh, as indices in position
 	std::vector<cgp::vec3> color;         // Colors of the mesh (ADDED)
 	//std::vector<cgp::vec3> uv;            // UV of the mesh (ADDED)
 	std::vector<cgp::marching_cube_relative_coordinates> relative; // Relative coordinates of the vertices expressed as an edge in the discrete grid 
@@ -28,7 +37,7 @@ struct implicit_surface_data {
 
 // Sub-structure that contains the elements that are displayed
 struct implicit_surface_drawable_structure {
-	cgp::triangles_drawable shape;     // Structure used to display the geometry
+	cgp::mesh_drawable shape;          // Structure used to display the geometry
 	cgp::curve_drawable domain_box;    // Structure used to display the box
 };
 
@@ -39,9 +48,21 @@ struct implicit_surface_structure
 	implicit_surface_data data_param;
 	implicit_surface_drawable_structure drawable_param;
 	implicit_surface_field_structure field_param;
+	cgp::spatial_domain_grid_3D domain;   // Domain of the next field, see set_domain
 
 	opengl_shader_structure shader;
 	float ground_level;
+	thread_pool* workers = nullptr;       // Evaluate the field in parallel when set
+	bool build_mesh = true;               // When false, only the field is computed (e.g. for the fish) and the terrain is drawn by other means
+
+	// Without mesh and with workers, update_field only starts a job computing pending_field, and field_param keeps the previous
+	// field (empty at first) until collect_field replaces it. Requests made meanwhile are merged into the next job.
+	thread_pool::job field_job;
+	implicit_surface_field_structure pending_field;
+	field_function_structure pending_function;
+	bool field_requested = false;         // update_field was called since field_job started
+
+	~implicit_surface_structure();
 
 	// Helpers functions that should be called in the scene
 	// *************************************************** //
@@ -49,6 +70,13 @@ struct implicit_surface_structure
 	//   Recompute from scratch the field and the marching cube
 	void update_field(field_function_structure const& field_function, float isovalue);
 
+	//   Replace field_param by the field computed on the workers once it is ready, to be called every frame
+	//   Returns true when field_param changed
+	bool collect_field();
+
+	//   Start computing the field of the last request on the workers
+	void start_field_job();
+
 	//   Recompute only the marching cube for a different isovalue (while minimize re-allocations)
 	void update_marching_cube(field_function_structure const& field_function, float isovalue);
 
@@ -56,14 +84,26 @@ struct implicit_surface_structure
 	void set_domain(float const& resolution, cgp::vec3 const& length);
 	
 	//   Helper function to update the gui and call the associated update functions
-	void gui_update(environment_structure& env, field_function_structure& field_function);
+	//   Returns true when the field or the isovalue changed
+	bool gui_update(environment_structure& env, field_function_structure& field_function);
 
 	void display_gui_implicit_surface(bool& is_update_field, bool& is_update_marching_cube, bool& is_save_obj, environment_structure& gui, field_function_structure& field_function);
 };
 
 
 // Compute a grid filled with the value of some scalar function - the size of the grid is given by the domain
-cgp::grid_3D<float> compute_discrete_scalar_field(cgp::spatial_domain_grid_3D const& domain, field_function_structure const& func);
+//  The slabs of constant z are shared between the workers if any. Each voxel only depends on its position, so the result does not depend on the number of threads.
+cgp::grid_3D<float> compute_discrete_scalar_field(cgp::spatial_domain_grid_3D const& domain, field_function_structure const& func, thread_pool* workers = nullptr);
 
 // Compute the gradient of the scalar field using finite differences on the voxels
 cgp::grid_3D<cgp::vec3> compute_gradient(cgp::grid_3D<float> const& field);
+
+// Compute the indexed marching cube of the field and the normals of the vertices, without sending anything to the GPU
+//  The slabs of cubes are shared between the workers if any, with the same result as without workers.
+void compute_marching_cube(implicit_surface_data& data, implicit_surface_field_structure const& field, float isovalue, thread_pool* workers = nullptr);
+
+// Mesh of the surface, with default colors and uv
+cgp::mesh implicit_surface_mesh(implicit_surface_data const& data);
+
+// Replace the buffers of shape by the mesh of the surface, with the shader, textures and material of appearance (which can be shape itself)
+void initialize_surface_drawable(cgp::mesh_drawable& shape, implicit_surface_data const& data, cgp::mesh_drawable const& appearance);
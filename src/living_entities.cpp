@@ -1,11 +1,64 @@
 #include "living_entities.hpp"
-#include <random>
+#include "mesh_simplification.hpp"
+#include <algorithm>
 
 using namespace cgp;
 
+int fish_population::size() const
+{
+	return position.size();
+}
+
+void fish_population::clear()
+{
+	position.clear();
+	direction.clear();
+	speed.clear();
+	frequency.clear();
+	modelId.clear();
+	school.clear();
+}
+
+/// <summary>
+/// Appends a fish to the population.
+/// </summary>
+/// <returns>Index of the new fish</returns>
+int fish_population::add(vec3 const& position_, vec3 const& direction_, float speed_, float frequency_, int modelId_, int school_)
+{
+	position.push_back(position_);
+	direction.push_back(direction_);
+	speed.push_back(speed_);
+	frequency.push_back(frequency_);
+	modelId.push_back(modelId_);
+	school.push_back(school_);
+	return size() - 1;
+}
+
+fish_school::fish_school()
+{
+	aggregated = false;
+	centroid = { 0, 0, 0 };
+	heading = { 1, 0, 0 };
+	speed = 0.0f;
+	spread = 0.0f;
+}
+
+fish_instances::fish_instances()
+{
+	count = 0;
+	capacity = 0;
+}
+
 fish_manager::fish_manager()
 {
 	ticks = 0;
+	tick_count = 0;
+	seed = 0;
+	simulation_rate = 60.0f;
+	max_substeps = 4;
+	accumulator = 0.0f;
+	step_scale = 1.0f;
+	workers = nullptr;
 	fish_groups_number = 6;
 	fishes_per_group = 30;
 
@@ -18,224 +71,504 @@ fish_manager::fish_manager()
 	this->obstacle_radius = 1.0f;
 	this->obstacle_coef = .05f;
 
-	grid_filled = false;
 	this->grid_step = 100;
+
+	// Aggregated schools
+	school_lod_distance = 900.0f;
+	school_lod_hysteresis = 0.1f;
+	camera_position = { 0, 0, 0 };
+
+	// Levels of detail
+	lod_number = 3;
+	lod_ratios = { 1.0f, 0.35f, 0.12f };
+	lod_distances = { 250.0f, 700.0f };
+	lod_hysteresis = 0.1f;
 }
 
 void fish_manager::initialize(vec3 domain, float ground_level, std::string project_path) {
+	initialize_domain(domain, ground_level);
+	initialize_models(project_path);
+}
+
+/// <summary>
+/// Sets the simulation domain and its grid. Needs no OpenGL context, so the simulation can run headless.
+/// </summary>
+void fish_manager::initialize_domain(vec3 domain, float ground_level)
+{
 	domain_x = domain.x;
 	domain_y = domain.y;
 	domain_z = -ground_level;
+	random = counter_rng(seed);
+}
 
+/// <summary>
+/// Loads the mesh, texture and shader of every species.
+/// </summary>
+void fish_manager::initialize_models(std::string project_path)
+{
 	float scales[5] = { 4.5f, 4.5f, 9.0f, 4.5f, 35.0f };
 
 	for (int i = 0; i < 5; i++) {
-		cgp::mesh_drawable drawable;
-
 		std::string path = std::to_string(i);
-		drawable.initialize_data_on_gpu(mesh_load_file_obj(project_path + "assets/fish" + path + "/fish" + path + ".obj"));
-		drawable.texture.load_and_initialize_texture_2d_on_gpu(project_path + "assets/fish" + path + "/fish" + path + ".png");
+		mesh const shape = mesh_load_file_obj(project_path + "assets/fish" + path + "/fish" + path + ".obj");
+		opengl_texture_image_structure texture;
+		texture.load_and_initialize_texture_2d_on_gpu(project_path + "assets/fish" + path + "/fish" + path + ".png");
 		opengl_shader_structure drawable_shader;
 		drawable_shader.load(
 			project_path + "shaders/fish" + path + "/vert.glsl",
 			project_path + "shaders/terrain/frag.glsl");
-		drawable.shader = drawable_shader;
-		drawable.model.scaling = scales[i];
-		drawable.material.texture_settings.two_sided = true;
 
-		fish_models.push_back(drawable);
+		// Levels of detail are simplified at load time, the level 0 being the original mesh
+		for (int lod = 0; lod < lod_number; lod++) {
+			cgp::mesh_drawable drawable;
+			drawable.initialize_data_on_gpu(lod == 0 ? shape : mesh_simplify(shape, lod_ratios[lod]));
+			drawable.texture = texture;
+			drawable.shader = drawable_shader;
+			drawable.model.scaling = scales[i]; // Only scaling: position and orientation are per-instance attributes
+			drawable.material.texture_settings.two_sided = true;
+
+			// Per-instance buffers, grown when needed by update_instances
+			fish_instances species;
+			species.capacity = 1;
+			species.position_phase.resize(species.capacity);
+			species.direction_frequency.resize(species.capacity);
+			drawable.initialize_supplementary_data_on_gpu(species.position_phase, 4, 1);
+			drawable.initialize_supplementary_data_on_gpu(species.direction_frequency, 5, 1);
+
+			fish_models.push_back(drawable);
+			instances.push_back(species);
+		}
 	}
 }
 
-void fish_manager::refresh(field_function_structure field, float t)
+/// <summary>
+/// Level of detail for a fish at the given distance of the camera, knowing its level at the previous frame.
+/// A fish only changes level once it is further than lod_hysteresis (relatively) from the distance threshold,
+/// so that fishes swimming around a threshold do not flicker between two meshes.
+/// </summary>
+int fish_manager::select_lod(int current, float distance) const
 {
-	std::random_device rd;
-	std::mt19937 gen(rd());
-	std::uniform_real_distribution<> distrib(0, 1);
-	refresh_grid();
-	ticks = ++ticks % 10;
-	// cgp::grid_3D<float> grid = *terrain_data->grid;
-	for (int i = 0; i < fishes.size(); i++)
-	{
-		fish& current = fishes[i];
-
-		// A positive field value means that the fish is inside a wall.
-		float val = field(current.position);
-		if (val > -obstacle_radius) {
-
-			float const dr = 10.0f;
-			float const grad_x = field(current.position + dr * vec3(1, 0, 0)) - val;
-			float const grad_y = field(current.position + dr * vec3(0, 1, 0)) - val;
-			float const grad_z = field(current.position + dr * vec3(0, 0, 1)) - val;
-
-			vec3 grad = vec3(grad_x, grad_y, grad_z);
-			if (cgp::norm(grad) > .001)
-				current.direction -= cgp::normalize(grad) * obstacle_coef;
-		}
-		cgp::vec3 separation = calculate_separation(current);
-		cgp::vec3 alignement = calculate_alignement(current);
-		cgp::vec3 cohesion = calculate_cohesion(current);
-		cgp::vec3 out_of_bound_force = calculate_out_of_bound_force(current);
-		current.direction += separation;
-		current.direction += alignement;
-		current.direction += cohesion;
-		current.direction += out_of_bound_force;
-		if (ticks % 10 == 0)
-			current.direction += {0.05 * (distrib(gen) - 0.5), 0.05 * (distrib(gen) - 0.5), 0.05 * (distrib(gen) - 0.5)};
-		current.direction.z *= 0.999f; // Attenuates vertical velocity in the long run.
-		current.direction = cgp::normalize(current.direction);
-		current.position = current.position + (fish_speed * current.direction);
+	int lod = std::min(std::max(current, 0), lod_number - 1);
+	while (lod + 1 < lod_number && distance > lod_distances[lod] * (1 + lod_hysteresis))
+		lod++;
+	while (lod > 0 && distance < lod_distances[lod - 1] * (1 - lod_hysteresis))
+		lod--;
+	return lod;
+}
+
+/// <summary>
+/// Advances the simulation by dt seconds using fixed ticks of 1 / simulation_rate.
+/// Left over time is kept for the next call, and at most max_substeps ticks are run so that a slow frame cannot snowball.
+/// </summary>
+void fish_manager::update(implicit_surface_field_structure const& obstacles, vec3 const& camera_position_, float dt)
+{
+	camera_position = camera_position_;
+
+	float const step = 1.0f / simulation_rate;
+	accumulator += dt;
+
+	int substeps = 0;
+	while (accumulator >= step && substeps < max_substeps) {
+		refresh(obstacles, step);
+		accumulator -= step;
+		substeps++;
 	}
+
+	// Drop the time that could not be simulated
+	if (accumulator >= step)
+		accumulator = std::fmod(accumulator, step);
 }
 
-void fish_manager::refresh_grid()
+/// <summary>
+/// Position of the rest of the frame between the two last ticks, in [0, 1].
+/// </summary>
+float fish_manager::interpolation_factor() const
+{
+	return std::min(accumulator * simulation_rate, 1.0f);
+}
+
+vec3 fish_manager::get_render_position(int fish) const
 {
-	int const max_x = 2 * domain_x / grid_step;
-	int const max_y = 2 * domain_y / grid_step;
-	int const max_z = domain_z / grid_step;
+	if (previous_position.size() != fishes.size())
+		return fishes.position[fish];
+	float const alpha = interpolation_factor();
+	return (1 - alpha) * previous_position[fish] + alpha * fishes.position[fish];
+}
 
-	// Free previous grid
-	if (grid_filled) {
-		for (int i = 0; i < max_x; ++i) {
-			for (int j = 0; j < max_y; ++j) {
-				delete[] fish_grid[i][j];
-			}
-			delete[] fish_grid[i];
+vec3 fish_manager::get_render_direction(int fish) const
+{
+	if (previous_direction.size() != fishes.size())
+		return fishes.direction[fish];
+	float const alpha = interpolation_factor();
+	return cgp::normalize((1 - alpha) * previous_direction[fish] + alpha * fishes.direction[fish], fishes.direction[fish]);
+}
+
+/// <summary>
+/// Fills the per-instance buffers of every species with the interpolated state of its fishes.
+/// The buffers on the GPU are only reallocated, doubling their size, when a species has more fishes than they can hold.
+/// </summary>
+void fish_manager::update_instances(vec3 const& camera_position)
+{
+	for (fish_instances& species : instances)
+		species.count = 0;
+
+	fish_lod.resize(fishes.size(), 0);
+	for (int i = 0; i < fishes.size(); i++) {
+		vec3 const position = get_render_position(i);
+		fish_lod[i] = select_lod(fish_lod[i], norm(position - camera_position));
+
+		fish_instances& species = instances[fishes.modelId[i] * lod_number + fish_lod[i]];
+		int const k = species.count++;
+		if (k >= species.position_phase.size()) {
+			species.position_phase.resize(std::max(1, 2 * k));
+			species.direction_frequency.resize(std::max(1, 2 * k));
 		}
-		delete[] fish_grid;
-	} else {
-		grid_filled = true;
+
+		// Swim animations are shifted from one fish to another with the golden ratio
+		float const phase = 2 * Pi * std::fmod(0.618034f * i, 1.0f);
+		vec3 const direction = get_render_direction(i);
+		species.position_phase[k] = { position.x, position.y, position.z, phase };
+		species.direction_frequency[k] = { direction.x, direction.y, direction.z, fishes.frequency[i] };
 	}
 
-	// Recreate an empty grid
-	fish_grid = new std::vector<fish> **[2 * domain_x / grid_step];
-	for (int i = 0; i < max_x; ++i) {
-		fish_grid[i] = new std::vector<fish> *[2 * domain_y / grid_step];
-		for (int j = 0; j < max_y; ++j) {
-			fish_grid[i][j] = new std::vector<fish>[domain_z / grid_step];
-			for (int k = 0; k < max_z; k++) {
-				fish_grid[i][j][k] = std::vector<fish>();
-			}
+	for (int m = 0; m < instances.size(); m++) {
+		fish_instances& species = instances[m];
+		mesh_drawable& drawable = fish_models[m];
+		if (species.count == 0)
+			continue;
+
+		if (species.count > species.capacity) {
+			species.capacity = species.position_phase.size();
+			drawable.supplementary_vbo[0].clear();
+			drawable.supplementary_vbo[1].clear();
+			drawable.initialize_supplementary_data_on_gpu(species.position_phase, 4, 1);
+			drawable.initialize_supplementary_data_on_gpu(species.direction_frequency, 5, 1);
+		}
+		else {
+			drawable.supplementary_vbo[0].update(species.position_phase, species.count);
+			drawable.supplementary_vbo[1].update(species.direction_frequency, species.count);
 		}
 	}
+}
 
-	for (fish f : fishes)
-	{
-		int posX = (int)(f.position.x + domain_x / 2);
-		posX = posX < 0 ? 0 : posX >= domain_x - 1 ? domain_x - 2
-													: posX;
-		int posY = (int)(f.position.y + domain_y / 2);
-		posY = posY < 0 ? 0 : posY >= domain_y - 1 ? domain_y - 2
-													: posY;
-		int posZ = (int)(f.position.z + domain_z / 2);
-		posZ = posZ < 0 ? 0 : posZ >= domain_z - 1 ? domain_z - 2
-												   : posZ;
-		fish_grid[posX / grid_step][posY / grid_step][posZ / grid_step].push_back(f);
-	}
+/// <summary>
+/// Draws every species with one instanced draw call per level of detail.
+/// </summary>
+void fish_manager::draw(environment_structure const& environment)
+{
+	update_instances(environment.get_camera_position());
+	for (int m = 0; m < instances.size(); m++)
+		if (instances[m].count > 0)
+			cgp::draw(fish_models[m], environment, instances[m].count);
+}
+
+void fish_manager::refresh(implicit_surface_field_structure const& obstacles, float dt)
+{
+	// Coefficients are tuned for 60 ticks per second, scale them to keep the same motion at any rate
+	step_scale = 60.0f * dt;
+
+	int const fish_number = fishes.size();
+	refresh_schools();
+	refresh_grid();
+	ticks = (ticks + 1) % 10;
+	tick_count++;
+
+	// Every fish reads the current state and writes into the back buffers, which are then swapped.
+	// Until the next tick, the back buffers thus hold the previous state used to interpolate the rendering.
+	previous_position.resize(fish_number);
+	previous_direction.resize(fish_number);
+
+	// Tasks are ranges of buckets holding roughly the same number of fishes
+	int const task_number = workers != nullptr ? 4 * workers->size() : 1;
+	auto const first_bucket = [&](int task) {
+		if (task >= task_number) return bucket_number;
+		int const first_fish = (int)((long long)task * fish_number / task_number);
+		return (int)(std::lower_bound(bucket_start.begin(), bucket_start.end(), first_fish) - bucket_start.begin());
+	};
+	auto const step_cells = [&](int task) {
+		int const begin = first_bucket(task);
+		int const end = first_bucket(task + 1);
+		for (int b = begin; b < end; b++)
+			for (int s = bucket_start[b]; s < bucket_start[b] + bucket_count[b]; s++)
+				if (!fish_aggregated[sorted_fishes[s]])
+					step_fish(sorted_fishes[s], obstacles);
+	};
+
+	if (workers != nullptr)
+		workers->run(task_number, step_cells);
+	else
+		step_cells(0);
+
+	for (int s = 0; s < schools.size(); s++)
+		if (schools[s].aggregated)
+			step_school(s, obstacles);
+
+	std::swap(fishes.position, previous_position);
+	std::swap(fishes.direction, previous_direction);
 }
 
-std::vector<fish> fish_manager::get_neighboring_fishes(fish current)
-{
-	// Iterates over the 27 cells around the fish
-	std::vector<fish> neighboring_fishes;
-	int posX = (int)(current.position.x + domain_x / 2);
-	posX = posX < 0 ? 0 : posX >= domain_x - 1 ? domain_x - 2
-												: posX;
-	int posY = (int)(current.position.y + domain_y / 2);
-	posY = posY < 0 ? 0 : posY >= domain_y - 1 ? domain_y - 2
-												: posY;
-	int posZ = (int)(current.position.z + domain_z / 2);
-	posZ = posZ < 0 ? 0 : posZ >= domain_z - 1 ? domain_z - 2
-											   : posZ;
-	for (int i = posX / grid_step - 1; i <= posX / grid_step + 1; i++)
-	{
-		for (int j = posY / grid_step - 1; j <= posY / grid_step + 1; j++)
-		{
-			for (int k = posZ / grid_step - 1; k <= posZ / grid_step + 1; k++)
-			{
-				if (i >= 0 && i < 2 * domain_x / grid_step && j >= 0 && j < 2 * domain_y / grid_step && k >= 0 && k < domain_z / grid_step)
-				{
-					for (fish f : fish_grid[i][j][k])
-					{
-						if (cgp::norm(f.position - current.position) < fish_radius)
-						{
-							neighboring_fishes.push_back(f);
-						}
-					}
+/// <summary>
+/// Computes the next state of one fish from the current state of the whole population.
+/// </summary>
+void fish_manager::step_fish(int i, implicit_surface_field_structure const& obstacles)
+{
+	vec3 const& position = fishes.position[i];
+	vec3 direction = fishes.direction[i];
+
+	direction += calculate_obstacle_force(position, obstacles) * step_scale;
+	cgp::vec3 boid_force = calculate_boid_force(i, direction);
+	cgp::vec3 out_of_bound_force = calculate_out_of_bound_force(position);
+	direction += boid_force * step_scale;
+	direction += out_of_bound_force * step_scale;
+	if (ticks == 0) // Random move every 10 ticks
+		direction += 0.025f * random.vector(i, 3 * tick_count) * step_scale;
+	direction.z *= std::pow(0.999f, step_scale); // Attenuates vertical velocity in the long run.
+	direction = cgp::normalize(direction);
+
+	previous_direction[i] = direction;
+	previous_position[i] = position + (fishes.speed[i] * step_scale * direction);
+}
+
+/// <summary>
+/// Rebuilds the members of the schools, then aggregates the schools which went far from the camera
+/// and turns the schools which came close back into regular fishes.
+/// </summary>
+void fish_manager::refresh_schools()
+{
+	int const fish_number = fishes.size();
+
+	int school_number = 0;
+	for (int i = 0; i < fish_number; i++)
+		school_number = std::max(school_number, fishes.school[i] + 1);
+	schools.resize(school_number);
+
+	for (fish_school& school : schools)
+		school.members.clear();
+	for (int i = 0; i < fish_number; i++)
+		if (fishes.school[i] >= 0)
+			schools[fishes.school[i]].members.push_back(i);
+
+	fish_aggregated.assign(fish_number, 0);
+	for (fish_school& school : schools) {
+		int const member_number = school.members.size();
+
+		// The offsets only match the members they were computed for
+		if (school.aggregated && school.offsets.size() != member_number)
+			school.aggregated = false;
+		if (member_number == 0)
+			continue;
+
+		// Members of an aggregated school are already at their place around the centroid, they only need to be simulated again
+		if (school.aggregated && norm(school.centroid - camera_position) - school.spread < school_lod_distance * (1 - school_lod_hysteresis))
+			school.aggregated = false;
+
+		if (!school.aggregated) {
+			vec3 centroid = { 0, 0, 0 };
+			for (int i : school.members)
+				centroid += fishes.position[i];
+			centroid /= float(member_number);
+
+			float spread = 0;
+			for (int i : school.members)
+				spread += dot(fishes.position[i] - centroid, fishes.position[i] - centroid);
+			spread = std::sqrt(spread / member_number);
+
+			if (norm(centroid - camera_position) - spread > school_lod_distance * (1 + school_lod_hysteresis)) {
+				vec3 heading = { 0, 0, 0 };
+				float speed = 0;
+				school.offsets.resize(member_number);
+				for (int k = 0; k < member_number; k++) {
+					int const i = school.members[k];
+					heading += fishes.direction[i];
+					speed += fishes.speed[i];
+					school.offsets[k] = fishes.position[i] - centroid;
 				}
+				school.aggregated = true;
+				school.centroid = centroid;
+				school.heading = cgp::normalize(heading, fishes.direction[school.members[0]]);
+				school.speed = speed / member_number;
+				school.spread = spread;
 			}
 		}
+
+		if (school.aggregated)
+			for (int i : school.members)
+				fish_aggregated[i] = 1;
 	}
-	return neighboring_fishes;
 }
 
-cgp::vec3 fish_manager::calculate_separation(fish current)
+/// <summary>
+/// Advances an aggregated school: the centroid follows the same steering as a lone fish, without the boid forces.
+/// </summary>
+void fish_manager::step_school(int s, implicit_surface_field_structure const& obstacles)
 {
-	cgp::vec3 sum = {0, 0, 0};
-	int count = 0;
-	std::vector<fish> neighboring_fishes = get_neighboring_fishes(current);
-	for (fish neighbor : neighboring_fishes)
-	{
-		cgp::vec3 delta = neighbor.position - current.position;
-		if (cgp::norm(delta) >= 0.00001 && cgp::norm(delta) < fish_radius)
-		{
-			sum += -delta / std::pow(cgp::norm(delta), 2);
-			count++;
-		}
+	fish_school& school = schools[s];
+
+	vec3 heading = school.heading;
+	heading += calculate_obstacle_force(school.centroid, obstacles) * step_scale;
+	heading += calculate_out_of_bound_force(school.centroid) * step_scale;
+	heading.z *= std::pow(0.999f, step_scale);
+	school.heading = cgp::normalize(heading, school.heading);
+	school.centroid += school.speed * step_scale * school.heading;
+
+	for (int k = 0; k < school.members.size(); k++) {
+		int const i = school.members[k];
+		previous_position[i] = school.centroid + school.offsets[k];
+		previous_direction[i] = school.heading;
 	}
-	if (count == 0)
-		return {0, 0, 0};
-	vec3 separation = separation_coef * (sum / count);
-	return separation - cgp::dot(separation, current.direction) * current.direction;
 }
-cgp::vec3 fish_manager::calculate_alignement(fish current)
+
+void fish_manager::refresh_grid()
 {
-	std::vector<fish> neighboring_fishes = get_neighboring_fishes(current);
-	cgp::vec3 sum = {0, 0, 0};
-	int modelId = current.modelId;
-	int count = 0;
-	for (fish neighbor: neighboring_fishes)
-	{
-		if (neighbor.modelId == modelId)
-		{
-			cgp::vec3 delta = neighbor.direction - current.direction;
-			if (cgp::norm(delta) >= 0.001 && cgp::norm(delta) < fish_radius)
-			{
-				sum += neighbor.direction;
-				count++;
-			}
-		}
+	int const fish_number = fishes.size();
+
+	// No allocation happens here unless the fish population grew
+	bucket_number = 64;
+	while (bucket_number < 2 * fish_number)
+		bucket_number *= 2;
+	bucket_start.resize(bucket_number);
+	bucket_count.assign(bucket_number, 0);
+	fish_bucket.resize(fish_number);
+	sorted_fishes.resize(fish_number);
+	neighbors.resize(fish_number);
+
+	// Count fishes per bucket
+	for (int i = 0; i < fish_number; i++) {
+		int const b = get_bucket(get_cell(fishes.position[i]));
+		fish_bucket[i] = b;
+		bucket_count[b]++;
+	}
+
+	// Exclusive prefix sum gives the first slot of each bucket
+	int offset = 0;
+	for (int b = 0; b < bucket_number; b++) {
+		bucket_start[b] = offset;
+		offset += bucket_count[b];
+	}
+
+	// Scatter fishes to their bucket, counts are rebuilt on the way
+	std::fill(bucket_count.begin(), bucket_count.end(), 0);
+	for (int i = 0; i < fish_number; i++) {
+		int const b = fish_bucket[i];
+		int const slot = bucket_start[b] + bucket_count[b]++;
+		sorted_fishes[slot] = i;
+		neighbors.set(slot, fishes.position[i], fishes.direction[i], fishes.modelId[i]);
 	}
-	if (count == 0)
-		return {0, 0, 0};
-	return alignement_coef * (sum / count);
 }
 
-cgp::vec3 fish_manager::calculate_cohesion(fish current)
+/// <summary>
+/// Cell containing a position. The grid is unbounded: fishes leaving the domain keep their own cells.
+/// The neighbor search relies on fish_radius <= grid_step to only visit the 27 cells around a fish.
+/// </summary>
+int3 fish_manager::get_cell(vec3 const& position) const
 {
-	std::vector<fish> neighboring_fishes = get_neighboring_fishes(current);
-	cgp::vec3 middle = {0, 0, 0};
-	int modelId = current.modelId;
+	return {
+		(int)std::floor(position.x / grid_step),
+		(int)std::floor(position.y / grid_step),
+		(int)std::floor(position.z / grid_step) };
+}
+
+/// <summary>
+/// Bucket of a cell in the hash table. Only the row (y, z) is hashed and x is added afterwards,
+/// so that the cells of a row along x land in consecutive buckets.
+/// </summary>
+int fish_manager::get_bucket(int3 const& cell) const
+{
+	unsigned int const row = (unsigned int)cell.y * 73856093u ^ (unsigned int)cell.z * 19349663u;
+	return (int)((row + (unsigned int)cell.x) & (unsigned int)(bucket_number - 1));
+}
+
+/// <summary>
+/// Ranges of slots holding the fishes of the 27 cells around a cell, each slot appearing once.
+/// Each row of 3 cells is 3 consecutive buckets (split in two when wrapping around the table). As rows may share buckets,
+/// overlapping bucket ranges are merged so that no fish is visited twice.
+/// </summary>
+/// <returns>Number of ranges [ranges[k].x, ranges[k].y) written</returns>
+int fish_manager::get_neighbor_ranges(int3 const& cell, int2 ranges[18]) const
+{
+	// Bucket ranges [first, last] of every row
+	int2 buckets[18];
 	int count = 0;
-	for (fish neighbor: neighboring_fishes)
-	{
-		if (neighbor.modelId == modelId)
-		{
-			cgp::vec3 delta = neighbor.position - current.position;
-			if (cgp::norm(delta) < fish_radius)
-			{
-				middle += neighbor.position;
-				count++;
+	for (int k = cell.z - 1; k <= cell.z + 1; k++) {
+		for (int j = cell.y - 1; j <= cell.y + 1; j++) {
+			int const first = get_bucket({ cell.x - 1, j, k });
+			int const last = first + 2;
+			if (last < bucket_number)
+				buckets[count++] = { first, last };
+			else {
+				buckets[count++] = { first, bucket_number - 1 };
+				buckets[count++] = { 0, last - bucket_number };
 			}
 		}
 	}
 
-	return cohesion_coef * ((middle / count) - current.position);
+	// Sort by first bucket and merge the overlaps
+	std::sort(buckets, buckets + count, [](int2 const& a, int2 const& b) { return a.x < b.x; });
+	int merged = 0;
+	for (int r = 0; r < count; r++) {
+		if (merged > 0 && buckets[r].x <= buckets[merged - 1].y + 1)
+			buckets[merged - 1].y = std::max(buckets[merged - 1].y, buckets[r].y);
+		else
+			buckets[merged++] = buckets[r];
+	}
+
+	for (int r = 0; r < merged; r++)
+		ranges[r] = { bucket_start[buckets[r].x], bucket_start[buckets[r].y] + bucket_count[buckets[r].y] };
+	return merged;
+}
+
+/// <summary>
+/// Separation, alignement and cohesion accumulated in a single walk over the 27 cells around the fish,
+/// visited as a few contiguous ranges of neighbors for boid_accumulate.
+/// </summary>
+/// <param name="direction">Current heading of the fish, after obstacle avoidance</param>
+boid_sums fish_manager::accumulate_neighbors(int fish, vec3 const& direction) const
+{
+	vec3 const& position = fishes.position[fish];
+	boid_sums sums;
+
+	int2 ranges[18];
+	int const range_number = get_neighbor_ranges(get_cell(position), ranges);
+	for (int r = 0; r < range_number; r++)
+		boid_accumulate(neighbors, ranges[r].x, ranges[r].y, position, direction, fishes.modelId[fish], fish_radius, sums);
+	return sums;
+}
+
+/// <returns>Sum of the three steering forces</returns>
+cgp::vec3 fish_manager::calculate_boid_force(int fish, vec3 const& direction) const
+{
+	vec3 const& position = fishes.position[fish];
+	boid_sums const sums = accumulate_neighbors(fish, direction);
+
+	cgp::vec3 force = {0, 0, 0};
+	if (sums.separation_count > 0) {
+		vec3 const separation = separation_coef * (sums.separation / sums.separation_count);
+		force += separation - cgp::dot(separation, direction) * direction;
+	}
+	if (sums.alignement_count > 0)
+		force += alignement_coef * (sums.alignement / sums.alignement_count);
+	if (sums.cohesion_count > 0)
+		force += cohesion_coef * ((sums.cohesion / sums.cohesion_count) - position);
+	return force;
+}
+
+/// <summary>
+/// Pushes away from the terrain when closer than obstacle_radius. A positive field value means being inside a wall.
+/// The field baked for the terrain is sampled instead of evaluating the noise of the field function.
+/// </summary>
+cgp::vec3 fish_manager::calculate_obstacle_force(vec3 const& position, implicit_surface_field_structure const& obstacles) const
+{
+	if (obstacles.field.size() == 0 || obstacles.sample(position) <= -obstacle_radius)
+		return { 0, 0, 0 };
+
+	vec3 const grad = obstacles.sample_gradient(position);
+	if (cgp::norm(grad) <= .0001)
+		return { 0, 0, 0 };
+	return -cgp::normalize(grad) * obstacle_coef;
 }
 
-cgp::vec3 fish_manager::calculate_out_of_bound_force(fish fish)
+cgp::vec3 fish_manager::calculate_out_of_bound_force(vec3 const& position) const
 {
-	vec3 position = fish.position;
 	float out_of_bound_force = 0.01f;
 	float forceX = position.x > domain_x * .5f ? -out_of_bound_force : position.x < -domain_x * .5f ? out_of_bound_force
 																			  : 0;
@@ -1,19 +1,57 @@
 #pragma once
 
 #include "cgp/cgp.hpp"
-#include "implicit_surface/field_function.hpp"
+#include "implicit_surface/implicit_surface.hpp"
+#include "thread_pool.hpp"
+#include "boid_kernel.hpp"
+#include "counter_rng.hpp"
 
-struct fish
+/// Structure of arrays holding the state of every fish, fish i being described by the i-th element of each array.
+/// Drawables are not stored per fish but once per species and level of detail in fish_manager::fish_models.
+struct fish_population
 {
-	cgp::vec3 position;
-	cgp::vec3 direction;
-	float speed;
-	cgp::mesh_drawable model;
-	int modelId;
-	float frequency;
-
-	float last_particle_emission;
-	float last_particle_emission_test;
+	std::vector<cgp::vec3> position;
+	std::vector<cgp::vec3> direction;
+	std::vector<float> speed;
+	std::vector<float> frequency;
+	std::vector<int> modelId;
+	std::vector<int> school; // Index in fish_manager::schools, -1 for a fish swimming alone
+
+	int size() const;
+
+	void clear();
+
+	int add(cgp::vec3 const& position, cgp::vec3 const& direction, float speed, float frequency, int modelId, int school);
+};
+
+/// <summary>
+/// Group of fishes spawned together. While it is far from the camera, the school is aggregated: it is advanced as a whole,
+/// its members keeping their position relatively to the centroid and swimming along the heading of the school.
+/// </summary>
+struct fish_school
+{
+	std::vector<int> members;
+	bool aggregated;
+
+	// State of the aggregate, only maintained while aggregated
+	cgp::vec3 centroid;
+	cgp::vec3 heading;
+	float speed;                    // Mean speed of the members
+	float spread;                   // Root mean square distance of the members to the centroid
+	std::vector<cgp::vec3> offsets; // Position of each member relatively to the centroid
+
+	fish_school();
+};
+
+/// Per-instance attributes of the fishes of one species, sent to the GPU at every frame so that the species is drawn in a single call.
+struct fish_instances
+{
+	cgp::numarray<cgp::vec4> position_phase;      // Position of the fish, and phase of its swim animation (location 4)
+	cgp::numarray<cgp::vec4> direction_frequency; // Heading of the fish, and frequency of its swim animation (location 5)
+	int count;    // Number of fishes of the species this frame
+	int capacity; // Number of instances the buffers on the GPU can hold
+
+	fish_instances();
 };
 
 struct fish_manager
@@ -21,29 +59,103 @@ struct fish_manager
 	fish_manager();
 
 	float domain_x, domain_y, domain_z;
-	bool grid_filled;
 	int ticks, grid_step;
 
-	std::vector<fish> fishes;
+	fish_population fishes;
+	/// Drawables of the species s at the level of detail l are fish_models[s * lod_number + l], the level 0 being the most detailed.
 	std::vector<cgp::mesh_drawable> fish_models;
-	std::vector<fish> ***fish_grid;
+	std::vector<fish_instances> instances; // In the order of fish_models
+
+	/// Levels of detail: the level l is used from lod_distances[l - 1] to lod_distances[l] away from the camera.
+	int lod_number;
+	std::vector<float> lod_ratios;    // Ratio of the triangles of the original mesh kept at each level
+	std::vector<float> lod_distances; // lod_number - 1 thresholds
+	float lod_hysteresis;             // Relative margin around the thresholds before a fish changes level
+	std::vector<int> fish_lod;        // Level of each fish at the last frame
+
+	/// Simulation level of detail: schools further than school_lod_distance from the camera are aggregated,
+	/// and become regular fishes again once closer than the distance (with the same relative hysteresis as the meshes).
+	std::vector<fish_school> schools;
+	std::vector<char> fish_aggregated; // Whether the school of each fish is aggregated
+	float school_lod_distance;
+	float school_lod_hysteresis;
+	cgp::vec3 camera_position; // Position given to the last update
+
+	/// Unbounded grid of cells of size grid_step, stored in a hash table rebuilt at every tick using a counting sort.
+	/// Fishes of the cells hashed to bucket b are sorted_fishes[bucket_start[b]] to sorted_fishes[bucket_start[b] + bucket_count[b] - 1],
+	/// and their state is copied at the same slots in neighbors. A bucket may hold several cells, far fishes being discarded by the radius test.
+	/// The buffers are only reallocated when the number of fishes grows.
+	int bucket_number; // Power of two, at least twice the number of fishes
+	std::vector<int> bucket_start;
+	std::vector<int> bucket_count;
+	std::vector<int> fish_bucket;
+	std::vector<int> sorted_fishes;
+	boid_neighbors neighbors;
+
+	/// Back buffers of the boid step, swapped with the population at the end of each tick.
+	/// Between two ticks they hold the previous state of the fishes.
+	std::vector<cgp::vec3> previous_position;
+	std::vector<cgp::vec3> previous_direction;
+
+	/// Random moves of the fishes, drawn from the fish index and the tick so that they do not depend on the threads
+	unsigned int seed;
+	counter_rng random;
+	unsigned int tick_count; // Ticks since the start of the simulation
+
+	/// Threads used by the boid step. It runs on the calling thread only when null.
+	thread_pool* workers;
+
+	/// Fixed step clock: ticks last 1 / simulation_rate seconds and the rendering is interpolated between the two last ones.
+	float simulation_rate;
+	int max_substeps; // Maximum number of ticks per update, the remaining time is dropped
+	float accumulator;
+	float step_scale; // Duration of the current tick relatively to the 60 ticks per second the coefficients are tuned for
+
 	int fish_groups_number;
 	int fishes_per_group;
 	float separation_coef, alignement_coef, cohesion_coef, fish_radius, fish_speed, obstacle_radius, obstacle_coef;
 
 	void initialize(cgp::vec3 domain, float floor_level, std::string project_path);
 
-	void refresh(field_function_structure field, float t);
+	void initialize_domain(cgp::vec3 domain, float floor_level);
+
+	void initialize_models(std::string project_path);
+
+	void update(implicit_surface_field_structure const& obstacles, cgp::vec3 const& camera_position, float dt);
+
+	float interpolation_factor() const;
+
+	cgp::vec3 get_render_position(int fish) const;
+
+	cgp::vec3 get_render_direction(int fish) const;
+
+	int select_lod(int current, float distance) const;
+
+	void update_instances(cgp::vec3 const& camera_position);
+
+	void draw(environment_structure const& environment);
+
+	void refresh(implicit_surface_field_structure const& obstacles, float dt);
+
+	void step_fish(int fish, implicit_surface_field_structure const& obstacles);
+
+	void refresh_schools();
+
+	void step_school(int school, implicit_surface_field_structure const& obstacles);
 
 	void refresh_grid();
 
-	std::vector<fish> get_neighboring_fishes(fish fish);
+	cgp::int3 get_cell(cgp::vec3 const& position) const;
+
+	int get_bucket(cgp::int3 const& cell) const;
+
+	int get_neighbor_ranges(cgp::int3 const& cell, cgp::int2 ranges[18]) const;
 
-	cgp::vec3 calculate_separation(fish fish);
+	boid_sums accumulate_neighbors(int fish, cgp::vec3 const& direction) const;
 
-	cgp::vec3 calculate_alignement(fish fish);
+	cgp::vec3 calculate_boid_force(int fish, cgp::vec3 const& direction) const;
 
-	cgp::vec3 calculate_cohesion(fish fish);
+	cgp::vec3 calculate_out_of_bound_force(cgp::vec3 const& position) const;
 
-	cgp::vec3 calculate_out_of_bound_force(fish fish);
+	cgp::vec3 calculate_obstacle_force(cgp::vec3 const& position, implicit_surface_field_structure const& obstacles) const;
 };
\ No newline at end of file
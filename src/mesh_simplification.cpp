@@ -0,0 +1,290 @@
+#include "mesh_simplification.hpp"
+
+#include <algorithm>
+#include <map>
+#include <queue>
+#include <tuple>
+
+using namespace cgp;
+
+/// Symmetric 4x4 matrix storing the sum of the squared distances to a set of planes.
+struct quadric
+{
+	double a[10];
+
+	quadric()
+	{
+		std::fill(a, a + 10, 0.0);
+	}
+
+	/// Squared distance to the plane n.p + d = 0, with n normalized, weighted by w
+	static quadric plane(vec3 const& n, float d, float w)
+	{
+		quadric q;
+		double const v[4] = { n.x, n.y, n.z, d };
+		int k = 0;
+		for (int i = 0; i < 4; i++)
+			for (int j = i; j < 4; j++)
+				q.a[k++] = w * v[i] * v[j];
+		return q;
+	}
+
+	quadric& operator+=(quadric const& q)
+	{
+		for (int k = 0; k < 10; k++)
+			a[k] += q.a[k];
+		return *this;
+	}
+
+	double error(vec3 const& p) const
+	{
+		double const x = p.x, y = p.y, z = p.z;
+		return a[0] * x * x + 2 * a[1] * x * y + 2 * a[2] * x * z + 2 * a[3] * x
+			+ a[4] * y * y + 2 * a[5] * y * z + 2 * a[6] * y
+			+ a[7] * z * z + 2 * a[8] * z
+			+ a[9];
+	}
+};
+
+struct collapse_candidate
+{
+	double cost;
+	int vertex; // Removed vertex
+	int target; // Vertex it is merged into
+	int version;
+
+	bool operator<(collapse_candidate const& other) const
+	{
+		return cost > other.cost; // Smallest cost on top of the queue
+	}
+};
+
+struct simplification_state
+{
+	mesh const* input;
+	std::vector<uint3> triangles;
+	std::vector<bool> triangle_removed;
+	std::vector<std::vector<int>> vertex_triangles; // Triangles around each vertex, may reference removed triangles
+	std::vector<int> position_id;                   // Vertices sharing the same position share the same id
+	std::vector<std::vector<int>> position_vertices; // Vertices of each position id
+	std::vector<quadric> quadrics;                  // Per position id
+	std::vector<bool> locked;
+	std::vector<int> version;
+
+	vec3 const& position(int v) const { return input->position[v]; }
+
+	bool contains_position(uint3 const& tri, int id) const
+	{
+		return position_id[tri[0]] == id || position_id[tri[1]] == id || position_id[tri[2]] == id;
+	}
+
+	/// Ids of the positions around a position, across texture seams
+	std::vector<int> neighbor_positions(int id) const
+	{
+		std::vector<int> neighbors;
+		for (int v : position_vertices[id]) {
+			for (int t : vertex_triangles[v]) {
+				if (triangle_removed[t])
+					continue;
+				for (int k = 0; k < 3; k++)
+					if (position_id[triangles[t][k]] != id)
+						neighbors.push_back(position_id[triangles[t][k]]);
+			}
+		}
+		std::sort(neighbors.begin(), neighbors.end());
+		neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+		return neighbors;
+	}
+
+	/// Checks that merging v into target keeps a manifold surface without flipped triangles
+	bool is_valid(int v, int target) const
+	{
+		// Link condition: the edge must be shared by exactly two triangles, whose third vertices are the only common neighbors
+		std::vector<int> const nv = neighbor_positions(position_id[v]);
+		std::vector<int> const nt = neighbor_positions(position_id[target]);
+		std::vector<int> common;
+		std::set_intersection(nv.begin(), nv.end(), nt.begin(), nt.end(), std::back_inserter(common));
+		if (common.size() != 2)
+			return false;
+
+		vec3 const& p = position(target);
+		for (int t : vertex_triangles[v]) {
+			if (triangle_removed[t])
+				continue;
+			uint3 const& tri = triangles[t];
+			if (contains_position(tri, position_id[target]))
+				continue; // Removed by the collapse
+
+			vec3 a = position(tri[0]), b = position(tri[1]), c = position(tri[2]);
+			vec3 const before = cross(b - a, c - a);
+			if ((int)tri[0] == v) a = p;
+			if ((int)tri[1] == v) b = p;
+			if ((int)tri[2] == v) c = p;
+			vec3 const after = cross(b - a, c - a);
+			if (dot(before, after) <= 0.2f * norm(before) * norm(after))
+				return false;
+		}
+		return true;
+	}
+
+	/// Cheapest vertex v can be merged into, if any
+	bool best_candidate(int v, collapse_candidate& candidate) const
+	{
+		if (locked[v])
+			return false;
+
+		quadric const& qv = quadrics[position_id[v]];
+		bool found = false;
+		for (int t : vertex_triangles[v]) {
+			if (triangle_removed[t])
+				continue;
+			for (int k = 0; k < 3; k++) {
+				int const target = triangles[t][k];
+				if (target == v)
+					continue;
+				quadric q = qv;
+				q += quadrics[position_id[target]];
+				double const cost = q.error(position(target));
+				if (!found || cost < candidate.cost) {
+					candidate = { cost, v, target, version[v] };
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+};
+
+mesh mesh_simplify(mesh const& input, float target_ratio)
+{
+	int const vertex_number = input.position.size();
+	int const triangle_number = input.connectivity.size();
+	int const target_triangles = std::max(1, (int)(target_ratio * triangle_number));
+
+	simplification_state state;
+	state.input = &input;
+	state.triangles.assign(input.connectivity.begin(), input.connectivity.end());
+	state.triangle_removed.assign(triangle_number, false);
+	state.vertex_triangles.resize(vertex_number);
+	state.locked.assign(vertex_number, false);
+	state.version.assign(vertex_number, 0);
+
+	// Weld vertices by position: the loader duplicates them along texture seams
+	std::map<std::tuple<float, float, float>, int> position_map;
+	state.position_id.resize(vertex_number);
+	for (int v = 0; v < vertex_number; v++) {
+		vec3 const& p = input.position[v];
+		auto const it = position_map.insert({ std::make_tuple(p.x, p.y, p.z), (int)position_map.size() });
+		state.position_id[v] = it.first->second;
+		if (it.second)
+			state.position_vertices.push_back({});
+		state.position_vertices[it.first->second].push_back(v);
+	}
+
+	// Quadrics from the plane of every triangle, weighted by its area
+	state.quadrics.resize(position_map.size());
+	std::map<std::pair<int, int>, int> edge_triangles;
+	for (int t = 0; t < triangle_number; t++) {
+		uint3 const& tri = state.triangles[t];
+		vec3 const n = cross(input.position[tri[1]] - input.position[tri[0]], input.position[tri[2]] - input.position[tri[0]]);
+		float const area = norm(n);
+		for (int k = 0; k < 3; k++) {
+			state.vertex_triangles[tri[k]].push_back(t);
+			int const a = state.position_id[tri[k]];
+			int const b = state.position_id[tri[(k + 1) % 3]];
+			edge_triangles[{ std::min(a, b), std::max(a, b) }]++;
+		}
+		if (area > 1e-12f) {
+			quadric const q = quadric::plane(n / area, -dot(n / area, input.position[tri[0]]), area);
+			for (int k = 0; k < 3; k++)
+				state.quadrics[state.position_id[tri[k]]] += q;
+		}
+	}
+
+	// Lock seams, open borders and non-manifold edges
+	std::vector<bool> locked_position(position_map.size(), false);
+	for (auto const& edge : edge_triangles) {
+		if (edge.second != 2) {
+			locked_position[edge.first.first] = true;
+			locked_position[edge.first.second] = true;
+		}
+	}
+	for (int v = 0; v < vertex_number; v++)
+		state.locked[v] = locked_position[state.position_id[v]] || state.position_vertices[state.position_id[v]].size() > 1;
+
+	std::priority_queue<collapse_candidate> queue;
+	for (int v = 0; v < vertex_number; v++) {
+		collapse_candidate candidate;
+		if (state.best_candidate(v, candidate))
+			queue.push(candidate);
+	}
+
+	int remaining = triangle_number;
+	while (remaining > target_triangles && !queue.empty())
+	{
+		collapse_candidate const candidate = queue.top();
+		queue.pop();
+
+		int const v = candidate.vertex;
+		int const target = candidate.target;
+		if (candidate.version != state.version[v] || !state.is_valid(v, target))
+			continue;
+
+		// Merge v into target
+		for (int t : state.vertex_triangles[v]) {
+			if (state.triangle_removed[t])
+				continue;
+			uint3& tri = state.triangles[t];
+			if (state.contains_position(tri, state.position_id[target])) {
+				state.triangle_removed[t] = true;
+				remaining--;
+				continue;
+			}
+			for (int k = 0; k < 3; k++)
+				if ((int)tri[k] == v)
+					tri[k] = target;
+			state.vertex_triangles[target].push_back(t);
+		}
+		state.vertex_triangles[v].clear();
+		state.quadrics[state.position_id[target]] += state.quadrics[state.position_id[v]];
+		state.version[v]++;
+
+		// The costs around the merged vertex changed
+		std::vector<int> around = { target };
+		for (int t : state.vertex_triangles[target])
+			if (!state.triangle_removed[t])
+				for (int k = 0; k < 3; k++)
+					around.push_back(state.triangles[t][k]);
+		std::sort(around.begin(), around.end());
+		around.erase(std::unique(around.begin(), around.end()), around.end());
+		for (int u : around) {
+			state.version[u]++;
+			collapse_candidate next;
+			if (state.best_candidate(u, next))
+				queue.push(next);
+		}
+	}
+
+	// Compact the vertices still in use
+	mesh output;
+	std::vector<int> new_index(vertex_number, -1);
+	for (int t = 0; t < triangle_number; t++) {
+		if (state.triangle_removed[t])
+			continue;
+		uint3 tri = state.triangles[t];
+		for (int k = 0; k < 3; k++) {
+			int& index = new_index[tri[k]];
+			if (index < 0) {
+				index = output.position.size();
+				output.position.push_back(input.position[tri[k]]);
+				if (input.normal.size() == vertex_number) output.normal.push_back(input.normal[tri[k]]);
+				if (input.color.size() == vertex_number) output.color.push_back(input.color[tri[k]]);
+				if (input.uv.size() == vertex_number) output.uv.push_back(input.uv[tri[k]]);
+			}
+			tri[k] = index;
+		}
+		output.connectivity.push_back(tri);
+	}
+	output.fill_empty_field();
+	return output;
+}
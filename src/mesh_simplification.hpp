@@ -0,0 +1,12 @@
+#pragma once
+
+#include "cgp/cgp.hpp"
+
+/// <summary>
+/// Simplified copy of a mesh with at most target_ratio of its triangles, using quadric error edge collapses (Garland and Heckbert).
+///
+/// Collapses are half-edge collapses: the removed vertex is merged into one of its neighbors, so the surviving vertices keep
+/// their normal, color and uv. Vertices duplicated along texture seams and vertices on open borders are never removed so
+/// that the textures and the silhouette are preserved, which may stop the simplification above the requested ratio.
+/// </summary>
+cgp::mesh mesh_simplify(cgp::mesh const& input, float target_ratio);
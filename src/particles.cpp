@@ -1,75 +1,138 @@
 #include "particles.hpp"
-#pragma once
+#include <algorithm>
+#include <limits>
+
+#ifdef CGP_SIMD_X86
+#include <immintrin.h>
+#endif
 
 using namespace cgp;
 
 /// <summary>
 /// Creates one particle which still needs to be registered afterwards.
+/// Mass, inertia and frictions are given by the particle type.
 /// </summary>
 /// <param name="position_">Initial position</param>
 /// <param name="velocity_">Initial velocity</param>
 /// <param name="angle_">Initial view angle of player</param>
 /// <param name="rot_speed_">Initial rotation velocity</param>
-/// <param name="mass_">Particule mass. Negative mass can account for high buoyancy</param>
-/// <param name="inertia_">Particle inertia (resistance to torque)</param>
-/// <param name="friction_">Particle friction (can be isotropic) ie resistance to motion inside of water/air</param>
-/// <param name="rot_friction_">Attenuation of rotation speed with time</param>
 /// <param name="lifetime_">Particle maximum lifetime</param>
 /// <param name="scale_">Particle scale, default is 1.0</param>
-particle::particle(vec3& position_, vec3& velocity_, float angle_, float rot_speed_, float mass_, float inertia_, vec3& friction_, float rot_friction_, float lifetime_, float scale_)
+particle::particle(vec3 const& position_, vec3 const& velocity_, float angle_, float rot_speed_, float lifetime_, float scale_)
 {
-	moving = true;
 	position = position_;
 	velocity = velocity_;
 	angle = angle_;
 	rot_speed = rot_speed_;
 
-	mass = mass_;
-	inertia = inertia_;
-	friction = friction_;
-	rot_friction = rot_friction_;
-
 	lifetime = lifetime_;
-	time_lived = .0f;
 	scale = scale_;
 }
 
 // No angle for symetrical particles
-particle::particle(vec3& position_, vec3& velocity_, float mass_, vec3& friction_, float lifetime_, float scale_)
+particle::particle(vec3 const& position_, vec3 const& velocity_, float lifetime_, float scale_)
+	: particle(position_, velocity_, 0, 0, lifetime_, scale_)
 {
-	moving = true;
-	position = position_;
-	velocity = velocity_;
-	angle = 0;
-	rot_speed = 0;
+}
 
-	mass = mass_;
-	inertia = 0;
-	friction = friction_;
-	rot_friction = 0;
+// Particles starting at rest
+particle::particle(vec3 const& position_, float lifetime_, float scale_)
+	: particle(position_, vec3(0, 0, 0), 0, 0, lifetime_, scale_)
+{
+}
 
-	lifetime = lifetime_;
-	time_lived = .0f;
-	scale = scale_;
+int particle_storage::size() const
+{
+	return x.size();
 }
 
-// Non moving particles.
-particle::particle(cgp::vec3& position_, float lifetime_, float scale_)
+vec3 particle_storage::position(int index) const
 {
-	moving = false;
-	position = position_;
-	velocity = vec3(0, 0, 0);
-	angle = 0;
-	rot_speed = 0;
+	return { x[index], y[index], z[index] };
+}
 
-	mass = 0;
-	inertia = 0;
-	friction = vec3(0, 0, 0);
-	rot_friction = 0;
+void particle_storage::reserve(int capacity)
+{
+	for (std::vector<float>* field : { &x, &y, &z, &vx, &vy, &vz, &angle, &rot_speed, &time_lived, &lifetime, &scale })
+		field->reserve(capacity);
+	type.reserve(capacity);
+}
 
-	lifetime = lifetime_;
-	time_lived = .0f;
-	scale = scale_;
+void particle_storage::resize(int size)
+{
+	for (std::vector<float>* field : { &x, &y, &z, &vx, &vy, &vz, &angle, &rot_speed, &time_lived, &lifetime, &scale })
+		field->resize(size);
+	type.resize(size);
+}
+
+void particle_storage::push_back(particle const& particle, int type_)
+{
+	x.push_back(particle.position.x);
+	y.push_back(particle.position.y);
+	z.push_back(particle.position.z);
+	vx.push_back(particle.velocity.x);
+	vy.push_back(particle.velocity.y);
+	vz.push_back(particle.velocity.z);
+	angle.push_back(particle.angle);
+	rot_speed.push_back(particle.rot_speed);
+	time_lived.push_back(.0f);
+	lifetime.push_back(particle.lifetime);
+	scale.push_back(particle.scale);
+	type.push_back(type_);
+}
+
+void particle_storage::move(int from, int to)
+{
+	for (std::vector<float>* field : { &x, &y, &z, &vx, &vy, &vz, &angle, &rot_speed, &time_lived, &lifetime, &scale })
+		(*field)[to] = (*field)[from];
+	type[to] = type[from];
+}
+
+void particle_storage::copy(particle_storage const& source, int from, int to)
+{
+	x[to] = source.x[from];
+	y[to] = source.y[from];
+	z[to] = source.z[from];
+	vx[to] = source.vx[from];
+	vy[to] = source.vy[from];
+	vz[to] = source.vz[from];
+	angle[to] = source.angle[from];
+	rot_speed[to] = source.rot_speed[from];
+	time_lived[to] = source.time_lived[from];
+	lifetime[to] = source.lifetime[from];
+	scale[to] = source.scale[from];
+	type[to] = source.type[from];
+}
+
+void particle_storage::append(particle_storage const& source, int begin, int end)
+{
+	auto const append_field = [begin, end](std::vector<float>& field, std::vector<float> const& source_field) {
+		field.insert(field.end(), source_field.begin() + begin, source_field.begin() + end);
+	};
+	append_field(x, source.x);
+	append_field(y, source.y);
+	append_field(z, source.z);
+	append_field(vx, source.vx);
+	append_field(vy, source.vy);
+	append_field(vz, source.vz);
+	append_field(angle, source.angle);
+	append_field(rot_speed, source.rot_speed);
+	append_field(time_lived, source.time_lived);
+	append_field(lifetime, source.lifetime);
+	append_field(scale, source.scale);
+	type.insert(type.end(), source.type.begin() + begin, source.type.begin() + end);
+}
+
+particle particle_storage::at(int index) const
+{
+	return particle(position(index), { vx[index], vy[index], vz[index] }, angle[index], rot_speed[index], lifetime[index], scale[index]);
+}
+
+void particle_storage::pop_back()
+{
+	for (std::vector<float>* field : { &x, &y, &z, &vx, &vy, &vz, &angle, &rot_speed, &time_lived, &lifetime, &scale })
+		field->pop_back();
+	type.pop_back();
 }
 
 void particle_manager::initialize(float& t, std::string& project_path)
@@ -77,6 +140,7 @@ void particle_manager::initialize(float& t, std::string& project_path)
 	z_limit = -30.0f;
 	last_time = t;
 	gravity = -9.81f * vec3(0.0f, 0.0f, 1.0f);
+	emission_random = counter_rng(3);
 
 	opengl_shader_structure particle_shader;
 	particle_shader.load(
@@ -90,64 +154,620 @@ void particle_manager::initialize(float& t, std::string& project_path)
 	bubble.initialize_data_on_gpu(quadrangle);
 	bubble.shader = particle_shader;
 	bubble.texture.load_and_initialize_texture_2d_on_gpu(project_path + "assets/particle/bubble1.png");
-	particle_types.push_back(particle_type(bubble, 1.0f));
+	particle_types.push_back(particle_type(bubble, 1.0f, -1.0f, 1.0f, .1f * vec3(2.0f, 2.0f, 1.0f), .1f));
 
 	// 1 Dot
 	mesh_drawable dot;
 	dot.initialize_data_on_gpu(quadrangle);
 	dot.shader = particle_shader;
 	dot.texture.load_and_initialize_texture_2d_on_gpu(project_path + "assets/particle/dot.png");
-	particle_types.push_back(particle_type(dot, .3f));
+	particle_types.push_back(particle_type(dot, .3f, -1.0f, 0.0f, vec3(0, 0, 1), 0.0f));
+
+	// Per-instance buffers, grown when needed by update_instances
+	for (particle_type& type : particle_types) {
+		type.capacity = 1;
+		type.position_scale.resize(type.capacity);
+		type.angle_opacity.resize(type.capacity);
+		type.drawable.initialize_supplementary_data_on_gpu(type.position_scale, 4, 1);
+		type.drawable.initialize_supplementary_data_on_gpu(type.angle_opacity, 5, 1);
+	}
+
+	update_type_coefficients();
+	set_capacity(capacity);
+
+#ifndef __EMSCRIPTEN__
+	// Geometry shaders are not available with OpenGL ES: the GPU simulation is only on desktop
+	feedback_shader = load_particle_feedback_shader(
+		project_path + "shaders/particle_feedback/vert.glsl",
+		project_path + "shaders/particle_feedback/geom.glsl");
+#endif
+}
+
+/// <summary>
+/// Integration of particles [begin, end) during dt:
+///  - ages grow by dt, particles above z_limit are given at most one more second to live
+///  - velocity += dt * (acceleration - damping * velocity), using the coefficients of the particle type
+///  - rotation speed += -dt * rot_damping * rotation speed
+///  - position and angle follow the new velocities
+/// </summary>
+void integrate_particles_scalar(particle_storage& p, particle_manager const& manager, int begin, int end, float dt)
+{
+	for (int i = begin; i < end; i++)
+	{
+		int const t = p.type[i];
+
+		p.time_lived[i] += dt;
+		if (p.z[i] > manager.z_limit)
+			p.time_lived[i] = std::max(p.lifetime[i] - 1.0f, p.time_lived[i]);
+
+		p.vx[i] += dt * (manager.acceleration_x[t] - manager.damping_x[t] * p.vx[i]);
+		p.vy[i] += dt * (manager.acceleration_y[t] - manager.damping_y[t] * p.vy[i]);
+		p.vz[i] += dt * (manager.acceleration_z[t] - manager.damping_z[t] * p.vz[i]);
+		p.rot_speed[i] -= dt * manager.rot_damping[t] * p.rot_speed[i];
+
+		p.x[i] += dt * p.vx[i];
+		p.y[i] += dt * p.vy[i];
+		p.z[i] += dt * p.vz[i];
+		p.angle[i] += dt * p.rot_speed[i];
+	}
+}
+
+#ifdef CGP_SIMD_X86
+
+/// <summary>
+/// AVX2 version of integrate_particles_scalar, updating 8 particles per iteration.
+/// The coefficients of the particle types are gathered from the per type tables.
+/// </summary>
+/// <returns>Index of the first particle left for the scalar code (less than 8 remaining)</returns>
+CGP_TARGET_AVX2
+static int integrate_particles_avx2(particle_storage& p, particle_manager const& manager, int begin, int end, float dt)
+{
+	__m256 const step = _mm256_set1_ps(dt);
+	__m256 const z_limit = _mm256_set1_ps(manager.z_limit);
+	__m256 const one = _mm256_set1_ps(1.0f);
+
+	int i = begin;
+	for (; i + 8 <= end; i += 8)
+	{
+		__m256i const t = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(&p.type[i]));
+
+		// Age
+		__m256 const z = _mm256_loadu_ps(&p.z[i]);
+		__m256 age = _mm256_add_ps(_mm256_loadu_ps(&p.time_lived[i]), step);
+		__m256 const last_second = _mm256_max_ps(_mm256_sub_ps(_mm256_loadu_ps(&p.lifetime[i]), one), age);
+		age = _mm256_blendv_ps(age, last_second, _mm256_cmp_ps(z, z_limit, _CMP_GT_OQ));
+		_mm256_storeu_ps(&p.time_lived[i], age);
+
+		// Velocities
+		__m256 vx = _mm256_loadu_ps(&p.vx[i]);
+		__m256 vy = _mm256_loadu_ps(&p.vy[i]);
+		__m256 vz = _mm256_loadu_ps(&p.vz[i]);
+		__m256 rot_speed = _mm256_loadu_ps(&p.rot_speed[i]);
+		vx = _mm256_fmadd_ps(step, _mm256_fnmadd_ps(_mm256_i32gather_ps(manager.damping_x.data(), t, 4), vx, _mm256_i32gather_ps(manager.acceleration_x.data(), t, 4)), vx);
+		vy = _mm256_fmadd_ps(step, _mm256_fnmadd_ps(_mm256_i32gather_ps(manager.damping_y.data(), t, 4), vy, _mm256_i32gather_ps(manager.acceleration_y.data(), t, 4)), vy);
+		vz = _mm256_fmadd_ps(step, _mm256_fnmadd_ps(_mm256_i32gather_ps(manager.damping_z.data(), t, 4), vz, _mm256_i32gather_ps(manager.acceleration_z.data(), t, 4)), vz);
+		rot_speed = _mm256_fnmadd_ps(_mm256_mul_ps(step, _mm256_i32gather_ps(manager.rot_damping.data(), t, 4)), rot_speed, rot_speed);
+		_mm256_storeu_ps(&p.vx[i], vx);
+		_mm256_storeu_ps(&p.vy[i], vy);
+		_mm256_storeu_ps(&p.vz[i], vz);
+		_mm256_storeu_ps(&p.rot_speed[i], rot_speed);
+
+		// Positions
+		_mm256_storeu_ps(&p.x[i], _mm256_fmadd_ps(step, vx, _mm256_loadu_ps(&p.x[i])));
+		_mm256_storeu_ps(&p.y[i], _mm256_fmadd_ps(step, vy, _mm256_loadu_ps(&p.y[i])));
+		_mm256_storeu_ps(&p.z[i], _mm256_fmadd_ps(step, vz, z));
+		_mm256_storeu_ps(&p.angle[i], _mm256_fmadd_ps(step, rot_speed, _mm256_loadu_ps(&p.angle[i])));
+	}
+	return i;
 }
 
+#endif
+
 void particle_manager::tick(float& t)
 {
 	// Time
 	float const dt = t - last_time;
 	last_time = t;
 
-	int i = 0;
-	while (i < active_particles.size()) {
-		particle* p_active = &active_particles.at(i);
+	if ((int)rot_damping.size() != (int)particle_types.size())
+		update_type_coefficients();
 
-		// Update time and unregister if needed
-		p_active->time_lived += dt;
-		if (p_active->time_lived > p_active->lifetime) {
-			active_particles.erase(active_particles.begin() + i);
-			continue;
+	// The GPU is only accessed from the rendering thread, in draw
+	if (gpu_simulation) {
+		gpu_elapsed_time += dt;
+		return;
+	}
+
+	int const particle_number = active_particles.size();
+	int const chunk_number = (particle_number + particle_chunk - 1) / particle_chunk;
+	chunk_offset.resize(chunk_number + 1);
+	auto const run = [&](std::function<void(int)> const& task) {
+		if (workers != nullptr)
+			workers->run(chunk_number, task);
+		else
+			for (int c = 0; c < chunk_number; c++)
+				task(c);
+	};
+
+	// Integrate every particle, including the ones dying during this tick, and count the survivors
+	run([&](int c) {
+		int const begin = c * particle_chunk;
+		int const end = std::min(begin + particle_chunk, particle_number);
+		int scalar_begin = begin;
+#ifdef CGP_SIMD_X86
+		if (cpu_has_avx2())
+			scalar_begin = integrate_particles_avx2(active_particles, *this, begin, end, dt);
+#endif
+		integrate_particles_scalar(active_particles, *this, scalar_begin, end, dt);
+
+		int survivors = 0;
+		for (int i = begin; i < end; i++)
+			survivors += active_particles.time_lived[i] <= active_particles.lifetime[i];
+		chunk_offset[c + 1] = survivors;
+	});
+
+	// Exclusive prefix sum gives the first slot of the survivors of each chunk
+	chunk_offset[0] = 0;
+	for (int c = 0; c < chunk_number; c++)
+		chunk_offset[c + 1] += chunk_offset[c];
+	int const survivor_number = chunk_offset[chunk_number];
+	if (survivor_number == particle_number)
+		return;
+
+	// Copy the survivors in order, the ids of the dead particles are released afterwards
+	compacted_particles.resize(survivor_number);
+	compacted_id.resize(survivor_number);
+	dead_ids.resize(particle_number - survivor_number);
+	run([&](int c) {
+		int const begin = c * particle_chunk;
+		int const end = std::min(begin + particle_chunk, particle_number);
+		int slot = chunk_offset[c];
+		int dead = begin - chunk_offset[c];
+		for (int i = begin; i < end; i++) {
+			int const id = particle_id[i];
+			if (active_particles.time_lived[i] > active_particles.lifetime[i]) {
+				dead_ids[dead++] = id;
+				continue;
+			}
+			compacted_particles.copy(active_particles, i, slot);
+			compacted_id[slot] = id;
+			particle_slot[id] = slot;
+			slot++;
 		}
+	});
+	std::swap(active_particles, compacted_particles);
+	particle_id.swap(compacted_id);
+
+	for (int id : dead_ids) {
+		particle_slot[id] = -1;
+		particle_generation[id]++;
+		free_ids.push_back(id);
+	}
+}
+
+/// <summary>
+/// Folds the force parameters of every particle type into the coefficients used by the integrator:
+/// acceleration = gravity * mass / |mass|, damping = friction / |mass| (mass 0 counts as 1), rot_damping = rot_friction / inertia (0 if inertia is 0).
+/// </summary>
+void particle_manager::update_type_coefficients()
+{
+	int const type_number = particle_types.size();
+	for (std::vector<float>* coefficient : { &acceleration_x, &acceleration_y, &acceleration_z, &damping_x, &damping_y, &damping_z, &rot_damping })
+		coefficient->resize(type_number);
+
+	for (int k = 0; k < type_number; k++) {
+		particle_type const& type = particle_types[k];
+		float const inverse_mass = type.mass != 0 ? 1.0f / std::abs(type.mass) : 1.0f;
+		vec3 const acceleration = gravity * type.mass * inverse_mass;
+		vec3 const damping = type.friction * inverse_mass;
+		acceleration_x[k] = acceleration.x;
+		acceleration_y[k] = acceleration.y;
+		acceleration_z[k] = acceleration.z;
+		damping_x[k] = damping.x;
+		damping_y[k] = damping.y;
+		damping_z[k] = damping.z;
+		rot_damping[k] = type.inertia != 0 ? type.rot_friction / type.inertia : 0.0f;
+	}
+}
+
+particle_emitter::particle_emitter(int entity_, int type_, float rate_, int burst_, float max_distance_, int budget_)
+{
+	entity = entity_;
+	type = type_;
+	rate = rate_;
+	burst = std::max(1, burst_);
+	max_distance = max_distance_;
+	budget = budget_;
+	next_time = 0;
+	emissions = 0;
+	gated = false;
+}
+
+/// Delay before the next emission of a Poisson process of the given rate
+static float emission_delay(counter_rng const& random, int emitter, uint32_t emission, float rate)
+{
+	return -std::log(1.0f - random.uniform(emitter, emission)) / std::max(rate, 1e-6f);
+}
+
+int particle_manager::add_emitter(particle_emitter const& emitter)
+{
+	int const index = emitters.size();
+	emitters.push_back(emitter);
+	particle_emitter& added = emitters.back();
+	added.next_time = last_time + emission_delay(emission_random, index, added.emissions, added.rate);
+	emission_queue.push_back({ added.next_time, index });
+	std::push_heap(emission_queue.begin(), emission_queue.end(), std::greater<std::pair<float, int>>());
+	return index;
+}
 
-		// Make particle die sooner if reaches Z limit
-		if (p_active->position.z > z_limit)
-			p_active->time_lived = std::max(p_active->lifetime - 1.0f, p_active->time_lived);
-		
-		// Forces and torques
-		vec3 const force = gravity * p_active->mass - p_active->velocity * p_active->friction;
-		double const torque = -p_active->rot_speed * p_active->rot_friction;
+/// <summary>
+/// Pops the emissions due at time t from the queue and registers their particles in one batch. Emitters out of budget leave the queue.
+/// After a long pause, emissions older than one second are skipped rather than all spawned at once.
+/// An emitter found out of range is checked again after the time the camera needs to reach max_distance at gate_speed. Once back
+/// in range, its next emission is drawn from that time: the process has no memory, so this is the same as skipping the emissions.
+/// </summary>
+void particle_manager::emit(float t, vec3 const& camera_position)
+{
+	auto const later = std::greater<std::pair<float, int>>();
+	while (!emission_queue.empty() && emission_queue.front().first <= t)
+	{
+		std::pop_heap(emission_queue.begin(), emission_queue.end(), later);
+		int const index = emission_queue.back().second;
+		emission_queue.pop_back();
 
-		// Update velocities
-		p_active->velocity += force * dt * (p_active->mass != 0 ? 1.0f / std::abs(p_active->mass) : 1.0f);
-		p_active->rot_speed += torque / p_active->inertia * dt;
+		particle_emitter& emitter = emitters[index];
+		if (emitter.budget == 0)
+			continue;
 
-		// Update positions
-		p_active->position += p_active->velocity * dt;
-		p_active->angle += p_active->rot_speed * dt;
+		bool const late = emitter.next_time < t - 1.0f;
+		if (!late || emitter.gated) {
+			vec3 const position = emitter.locate(emitter.entity);
+			float const distance = norm(position - camera_position);
+			if (distance > emitter.max_distance) {
+				emitter.gated = true;
+				emitter.next_time = t + std::min(std::max((distance - emitter.max_distance) / gate_speed, min_gate_delay), max_gate_delay);
+				emission_queue.push_back({ emitter.next_time, index });
+				std::push_heap(emission_queue.begin(), emission_queue.end(), later);
+				continue;
+			}
 
-		++i;
+			if (!emitter.gated) {
+				int const count = emitter.budget < 0 ? emitter.burst : std::min(emitter.burst, emitter.budget);
+				for (int k = 0; k < count; k++)
+					emitted.push_back(emitter.spawn(emitter.entity, position, emitter.emissions * emitter.burst + k), emitter.type);
+				if (emitter.budget > 0)
+					emitter.budget -= count;
+			}
+		}
+
+		emitter.emissions++;
+		emitter.next_time = (emitter.gated ? t : std::max(emitter.next_time, t - 1.0f)) + emission_delay(emission_random, index, emitter.emissions, emitter.rate);
+		emitter.gated = false;
+		if (emitter.budget != 0) {
+			emission_queue.push_back({ emitter.next_time, index });
+			std::push_heap(emission_queue.begin(), emission_queue.end(), later);
+		}
 	}
+
+	register_particles(emitted);
+	emitted.resize(0);
 }
 
-void particle_manager::register_particle(particle& particle, int model_id)
+particle_handle particle_manager::register_particle(particle const& particle, int model_id)
 {
-	// Missing fields
-	particle.type = &particle_types.at(model_id);
+#ifndef __EMSCRIPTEN__
+	if (gpu_simulation) {
+		gpu_particle_system& system = gpu_systems.at(model_id);
+		if (system.count + (int)system.spawned.size() >= system.capacity) {
+			dropped_particles++;
+			return { -1, 0 };
+		}
+		vec3 const& p = particle.position;
+		float const opacity = std::min(particle.lifetime, 1.0f);
+		system.spawned.push_back({ { p.x, p.y, p.z, particle.scale }, { particle.angle, opacity }, particle.velocity, { particle.rot_speed, 0.0f, particle.lifetime } });
+		return { -1, 0 };
+	}
+#endif
+
+	int slot = active_particles.size();
+	if (slot >= capacity) {
+		dropped_particles++;
+		if (drop_policy == drop_new_particle || capacity == 0)
+			return { -1, 0 };
+
+		// Replace the particle with the least remaining lifetime
+		slot = 0;
+		for (int i = 1; i < (int)active_particles.size(); i++)
+			if (active_particles.lifetime[i] - active_particles.time_lived[i] < active_particles.lifetime[slot] - active_particles.time_lived[slot])
+				slot = i;
+		remove_slot(slot);
+		slot = active_particles.size();
+	}
+
+	int const id = allocate_id();
 
 	// Add to particle registry
-	active_particles.push_back(particle);
+	assert_cgp(model_id >= 0 && model_id < (int)particle_types.size(), "Unknown particle type");
+	active_particles.push_back(particle, model_id);
+	particle_id.push_back(id);
+	particle_slot[id] = slot;
+	return { id, particle_generation[id] };
+}
+
+void particle_manager::register_particles(particle_storage const& source)
+{
+	int const count = source.size();
+	int batch = std::min(count, capacity - active_particles.size());
+	if (gpu_simulation)
+		batch = 0; // The GPU systems already gather the spawned particles, uploaded once per frame
+	batch = std::max(batch, 0);
+
+	int const first = active_particles.size();
+	active_particles.append(source, 0, batch);
+	particle_id.resize(first + batch);
+	for (int k = 0; k < batch; k++) {
+		assert_cgp(source.type[k] >= 0 && source.type[k] < (int)particle_types.size(), "Unknown particle type");
+		int const id = allocate_id();
+		particle_id[first + k] = id;
+		particle_slot[id] = first + k;
+	}
+
+	// Beyond the capacity, the drop policy applies to each particle
+	for (int k = batch; k < count; k++)
+		register_particle(source.at(k), source.type[k]);
+}
+
+int particle_manager::allocate_id()
+{
+	if (free_ids.empty()) {
+		particle_slot.push_back(-1);
+		particle_generation.push_back(0);
+		return particle_slot.size() - 1;
+	}
+	int const id = free_ids.back();
+	free_ids.pop_back();
+	return id;
+}
+
+void particle_manager::remove_particle(particle_handle handle)
+{
+	if (is_alive(handle))
+		remove_slot(particle_slot[handle.id]);
+}
+
+bool particle_manager::is_alive(particle_handle handle) const
+{
+	return handle.id >= 0 && handle.id < (int)particle_slot.size() && particle_generation[handle.id] == handle.generation && particle_slot[handle.id] >= 0;
+}
+
+int particle_manager::get_slot(particle_handle handle) const
+{
+	return is_alive(handle) ? particle_slot[handle.id] : -1;
+}
+
+void particle_manager::set_capacity(int capacity_)
+{
+	capacity = std::max(0, capacity_);
+	while ((int)active_particles.size() > capacity)
+		remove_slot(active_particles.size() - 1);
+
+	// Every buffer is allocated once here, the pool never allocates afterwards
+	active_particles.reserve(capacity);
+	compacted_particles.reserve(capacity);
+	particle_id.reserve(capacity);
+	compacted_id.reserve(capacity);
+	dead_ids.reserve(capacity);
+	particle_slot.reserve(capacity);
+	particle_generation.reserve(capacity);
+	free_ids.reserve(capacity);
+}
+
+/// <summary>
+/// Kills the particle at a slot in constant time: the last particle is moved to its slot.
+/// </summary>
+void particle_manager::remove_slot(int slot)
+{
+	int const id = particle_id[slot];
+	particle_slot[id] = -1;
+	particle_generation[id]++;
+	free_ids.push_back(id);
+
+	int const last = active_particles.size() - 1;
+	if (slot != last) {
+		active_particles.move(last, slot);
+		particle_id[slot] = particle_id[last];
+		particle_slot[particle_id[slot]] = slot;
+	}
+	active_particles.pop_back();
+	particle_id.pop_back();
+}
+
+/// <summary>
+/// Sends the first count elements of data to a per-instance buffer, orphaning its previous storage so that
+/// the driver does not wait for the draw calls of the previous frame still reading it.
+/// </summary>
+template <typename T>
+static void stream_instances(opengl_vbo_structure& vbo, numarray<T> const& data, int count)
+{
+	glBindBuffer(GL_ARRAY_BUFFER, vbo.id);
+	glBufferData(GL_ARRAY_BUFFER, GLsizeiptr(size_in_memory(data)), nullptr, GL_STREAM_DRAW);
+	glBufferSubData(GL_ARRAY_BUFFER, 0, GLsizeiptr(count * sizeof(T)), ptr(data));
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
 }
 
-particle_type::particle_type(cgp::mesh_drawable& drawable_, float scale_)
+/// <summary>
+/// Back to front order of the particles, needed as transparent quads are drawn without depth buffer.
+/// The view depth is quantized on 16 bits between the nearest and the furthest particle, then the slots are sorted
+/// by a least significant digit radix sort on two bytes: linear time, and only sequential reads and writes.
+/// </summary>
+void particle_manager::sort_by_depth(mat4 const& camera_view)
+{
+	particle_storage const& p = active_particles;
+	int const particle_number = p.size();
+	depth_keys.resize(particle_number);
+	depth_keys_scratch.resize(particle_number);
+	draw_order.resize(particle_number);
+	sort_scratch.resize(particle_number);
+	if (particle_number == 0)
+		return;
+
+	// Distance in front of the camera, which looks toward -z in view space
+	float const ax = -camera_view(2, 0), ay = -camera_view(2, 1), az = -camera_view(2, 2), a0 = -camera_view(2, 3);
+	float depth_min = std::numeric_limits<float>::max();
+	float depth_max = std::numeric_limits<float>::lowest();
+	for (int i = 0; i < particle_number; i++) {
+		float const depth = ax * p.x[i] + ay * p.y[i] + az * p.z[i] + a0;
+		depth_min = std::min(depth_min, depth);
+		depth_max = std::max(depth_max, depth);
+	}
+
+	// Key 0 is the furthest particle
+	float const quantization = depth_max > depth_min ? 65535.0f / (depth_max - depth_min) : 0.0f;
+	for (int i = 0; i < particle_number; i++) {
+		float const depth = ax * p.x[i] + ay * p.y[i] + az * p.z[i] + a0;
+		depth_keys[i] = (uint16_t)((depth_max - depth) * quantization);
+		draw_order[i] = i;
+	}
+
+	// One stable counting sort per byte, the lowest first
+	for (int shift = 0; shift < 16; shift += 8) {
+		int offset[257] = { 0 };
+		for (int i = 0; i < particle_number; i++)
+			offset[((depth_keys[i] >> shift) & 0xff) + 1]++;
+		for (int b = 0; b < 256; b++)
+			offset[b + 1] += offset[b];
+		for (int i = 0; i < particle_number; i++) {
+			int const k = offset[(depth_keys[i] >> shift) & 0xff]++;
+			depth_keys_scratch[k] = depth_keys[i];
+			sort_scratch[k] = draw_order[i];
+		}
+		depth_keys.swap(depth_keys_scratch);
+		draw_order.swap(sort_scratch);
+	}
+}
+
+/// <summary>
+/// Fills the per-instance buffers of every type with the live particles, in draw_order so that each draw call blends them back to front.
+/// The buffers on the GPU are only reallocated, doubling their size, when a type has more particles than they can hold.
+/// </summary>
+void particle_manager::update_instances()
+{
+	for (particle_type& type : particle_types)
+		type.count = 0;
+
+	particle_storage const& p = active_particles;
+	for (int i : draw_order) {
+		particle_type& type = particle_types[p.type[i]];
+		int const k = type.count++;
+		if (k >= type.position_scale.size()) {
+			type.position_scale.resize(std::max(1, 2 * k));
+			type.angle_opacity.resize(std::max(1, 2 * k));
+		}
+
+		// Particle fades out during last X seconds
+		float const fadeout_time = 1.0f;
+		float const opacity_multiplier = std::min(p.lifetime[i] - p.time_lived[i], fadeout_time) / fadeout_time;
+
+		type.position_scale[k] = { p.x[i], p.y[i], p.z[i], p.scale[i] };
+		type.angle_opacity[k] = { p.angle[i], opacity_multiplier };
+	}
+
+	for (particle_type& type : particle_types) {
+		if (type.count == 0)
+			continue;
+
+		mesh_drawable& drawable = type.drawable;
+		if (type.count > type.capacity) {
+			type.capacity = type.position_scale.size();
+			drawable.supplementary_vbo[0].clear();
+			drawable.supplementary_vbo[1].clear();
+			drawable.initialize_supplementary_data_on_gpu(type.position_scale, 4, 1);
+			drawable.initialize_supplementary_data_on_gpu(type.angle_opacity, 5, 1);
+		}
+		else {
+			stream_instances(drawable.supplementary_vbo[0], type.position_scale, type.count);
+			stream_instances(drawable.supplementary_vbo[1], type.angle_opacity, type.count);
+		}
+	}
+}
+
+/// <summary>
+/// Draws every particle type with one instanced draw call, sorted back to front.
+/// </summary>
+void particle_manager::draw(environment_structure const& environment, rotation_transform const& orientation)
+{
+#ifndef __EMSCRIPTEN__
+	if (gpu_simulation) {
+		for (int k = 0; k < (int)gpu_systems.size(); k++) {
+			vec3 const acceleration = { acceleration_x[k], acceleration_y[k], acceleration_z[k] };
+			vec3 const damping = { damping_x[k], damping_y[k], damping_z[k] };
+			gpu_systems[k].step(feedback_shader, gpu_elapsed_time, z_limit, acceleration, damping, rot_damping[k]);
+			gpu_systems[k].draw(environment, orientation, particle_types[k].scale);
+		}
+		gpu_elapsed_time = 0;
+		return;
+	}
+#endif
+
+	sort_by_depth(environment.camera_view);
+	update_instances();
+	for (particle_type& type : particle_types) {
+		if (type.count == 0)
+			continue;
+		type.drawable.model.rotation = orientation;
+		type.drawable.model.scaling = type.scale; // Translation and per-particle scale are per-instance attributes
+		cgp::draw(type.drawable, environment, type.count);
+	}
+}
+
+int particle_manager::live_particles() const
+{
+	if (!gpu_simulation)
+		return active_particles.size();
+	int count = 0;
+#ifndef __EMSCRIPTEN__
+	for (gpu_particle_system const& system : gpu_systems)
+		count += system.count;
+#endif
+	return count;
+}
+
+void particle_manager::set_gpu_simulation(bool enabled)
+{
+#ifdef __EMSCRIPTEN__
+	enabled = false;
+#else
+	if (feedback_shader.id == 0)
+		enabled = false;
+#endif
+	if (enabled == gpu_simulation)
+		return;
+
+	while (active_particles.size() > 0)
+		remove_slot(active_particles.size() - 1);
+#ifndef __EMSCRIPTEN__
+	// The GPU buffers only exist in the GPU mode
+	for (gpu_particle_system& system : gpu_systems)
+		system.clear();
+	gpu_systems.clear();
+	if (enabled) {
+		gpu_systems.resize(particle_types.size());
+		for (int k = 0; k < (int)particle_types.size(); k++)
+			gpu_systems[k].initialize(particle_types[k].drawable, gpu_capacity);
+	}
+#endif
+	gpu_elapsed_time = 0;
+	gpu_simulation = enabled;
+}
+
+particle_type::particle_type(cgp::mesh_drawable& drawable_, float scale_, float mass_, float inertia_, cgp::vec3 const& friction_, float rot_friction_)
 {
 	drawable = drawable_;
 	scale = scale_;
+	mass = mass_;
+	inertia = inertia_;
+	friction = friction_;
+	rot_friction = rot_friction_;
+	count = 0;
+	capacity = 0;
 }
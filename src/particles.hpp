@@ -1,48 +1,242 @@
 #pragma once
 
 #include "cgp/cgp.hpp"
+#include "environment.hpp"
+#include "counter_rng.hpp"
+#include "thread_pool.hpp"
+#include "gpu_particles.hpp"
+#include <cstdint>
+#include <functional>
+#include <limits>
 
+/// <summary>
+/// Appearance and physics shared by every particle of a type.
+/// </summary>
 struct particle_type {
 	cgp::mesh_drawable drawable;
 	float scale;
 
-	particle_type(cgp::mesh_drawable& drawable_, float scale_);
+	// Force parameters
+	float mass;             // Negative mass can account for high buoyancy, 0 for particles only slowed down by friction
+	float inertia;          // Resistance to torque, 0 for particles that keep their rotation speed
+	cgp::vec3 friction;     // Resistance to motion inside of water/air (can be anisotropic)
+	float rot_friction;     // Attenuation of rotation speed with time
+
+	// Per-instance buffers, one particle per instance
+	cgp::numarray<cgp::vec4> position_scale; // Position of the particle, and its scale (location 4)
+	cgp::numarray<cgp::vec2> angle_opacity;  // Rotation of the quad in its plane, and opacity multiplier (location 5)
+	int count;    // Number of particles of the type this frame
+	int capacity; // Number of instances the buffers on the GPU can hold
+
+	particle_type(cgp::mesh_drawable& drawable_, float scale_, float mass_, float inertia_, cgp::vec3 const& friction_, float rot_friction_);
 };
 
+/// <summary>
+/// Initial state of a particle, copied into the pool by particle_manager::register_particle.
+/// </summary>
 struct particle {
 
 	// Cinematic
 	cgp::vec3 velocity, position;
 	float rot_speed, angle;
-	bool moving;
-
-	// Force parameters
-	float mass, inertia;
-	cgp::vec3 friction;
-	float rot_friction;
 
 	// Generic parameters
-	float lifetime, time_lived, scale;
-	particle_type* type; // Initialized when registered
+	float lifetime, scale;
+
+	particle(cgp::vec3 const& position_, float lifetime_, float scale_);
+
+	particle(cgp::vec3 const& position_, cgp::vec3 const& velocity_, float angle_, float rot_speed_, float lifetime_, float scale_);
+
+	particle(cgp::vec3 const& position_, cgp::vec3 const& velocity_, float lifetime_, float scale_);
+};
+
+/// <summary>
+/// Live particles, with one array per field so that the integrator updates 8 particles at a time.
+/// </summary>
+struct particle_storage {
+	std::vector<float> x, y, z;    // Position
+	std::vector<float> vx, vy, vz; // Velocity
+	std::vector<float> angle, rot_speed;
+	std::vector<float> time_lived, lifetime, scale;
+	std::vector<int> type;
+
+	int size() const;
+
+	cgp::vec3 position(int index) const;
+
+	void reserve(int capacity);
+
+	void resize(int size);
+
+	void push_back(particle const& particle, int type_);
+
+	/// Copies the particle at slot from into slot to
+	void move(int from, int to);
+
+	/// Copies the particle at slot from of source into slot to
+	void copy(particle_storage const& source, int from, int to);
+
+	/// Appends the particles [begin, end) of source, one copy per field
+	void append(particle_storage const& source, int begin, int end);
+
+	particle at(int index) const;
+
+	void pop_back();
+};
+
+/// <summary>
+/// Source of particles attached to an entity of the scene (a fish, an alga...), updated by particle_manager::emit.
+/// Emissions follow a Poisson process: the time of the next one is drawn when the previous one happens, so the emission
+/// rate does not depend on the frame rate, and the cost only depends on the number of emissions, not on the number of emitters.
+/// An emitter further than max_distance is not scheduled at its rate, but checked again once the camera may have come within range.
+/// </summary>
+struct particle_emitter {
+	int entity;          // Passed to locate and spawn
+	int type;            // Type of the emitted particles
+	float rate;          // Emissions per second
+	int burst;           // Particles per emission
+	float max_distance;  // Emissions further than this from the camera are skipped
+	int budget;          // Particles left to emit, negative for no limit
+
+	std::function<cgp::vec3(int entity)> locate; // Current position of the entity
+	std::function<particle(int entity, cgp::vec3 const& position, uint32_t sequence)> spawn; // sequence numbers the particles of the emitter, e.g. to draw random numbers
+
+	// State
+	float next_time;
+	uint32_t emissions;
+	bool gated;          // Out of range: next_time is the next check of the distance, not an emission
 
-	particle(cgp::vec3& position_, float lifetime_, float scale_);
+	particle_emitter(int entity_, int type_, float rate_, int burst_ = 1, float max_distance_ = std::numeric_limits<float>::max(), int budget_ = -1);
+};
+
+/// What register_particle does when the pool is full
+enum particle_drop_policy {
+	drop_new_particle,     // The new particle is discarded
+	replace_dying_particle // The new particle replaces the one closest to the end of its lifetime (linear search)
+};
 
-	particle(cgp::vec3& position_, cgp::vec3& velocity_, float angle_, float rot_speed_, float mass_, float inertia_, cgp::vec3& friction_, float rot_friction_, float lifetime_, float scale_);
-	
-	particle(cgp::vec3& position_, cgp::vec3& velocity_, float mass_, cgp::vec3& friction_, float lifetime_, float scale_);
+/// Identifies a registered particle whatever its slot in the pool. Stale once the particle died.
+struct particle_handle {
+	int id;
+	unsigned int generation;
 };
 
 struct particle_manager
 {
 	float last_time, z_limit;
 	cgp::vec3 gravity;
-	std::vector<particle> active_particles;
 	std::vector<particle_type> particle_types;
 
+	/// <summary>
+	/// Pool of live particles, kept contiguous: a dead particle is replaced by the last one (swap and pop).
+	/// Nothing is allocated once the pool reached its capacity, which bounds the number of live particles.
+	/// Handles go through particle_slot, updated when a particle is moved.
+	/// </summary>
+	particle_storage active_particles;
+	std::vector<int> particle_id;             // Per slot: id of the particle
+	std::vector<int> particle_slot;           // Per id: slot of the particle, -1 if dead
+	std::vector<unsigned int> particle_generation; // Per id: incremented when the particle dies
+	std::vector<int> free_ids;
+	int capacity = 8192;
+	particle_drop_policy drop_policy = drop_new_particle;
+	int dropped_particles = 0; // Particles discarded or replaced since the start
+
+	/// <summary>
+	/// tick splits the pool in chunks of particle_chunk particles, run on the workers if any.
+	/// Each chunk integrates its particles and counts the survivors, then a prefix sum over the chunks gives where each chunk
+	/// copies its survivors into compacted_particles, which becomes the pool. Unlike remove_slot, this keeps the order of the particles.
+	/// </summary>
+	thread_pool* workers = nullptr;
+	int particle_chunk = 4096;
+	particle_storage compacted_particles;
+	std::vector<int> compacted_id;
+	std::vector<int> chunk_offset; // Per chunk: number of survivors, then first slot of its survivors after the prefix sum
+	std::vector<int> dead_ids;
+
+	/// Emitters, and the time of their next emission in a min-heap
+	std::vector<particle_emitter> emitters;
+	std::vector<std::pair<float, int>> emission_queue;
+	counter_rng emission_random; // Keyed by emitter index and emission number
+	float gate_speed = 200.0f;   // Fastest the camera and an emitter out of range get closer, sets when the emitter is checked again
+	float min_gate_delay = 0.1f, max_gate_delay = 10.0f; // Bounds of the delay before checking an emitter out of range again
+	particle_storage emitted;    // Particles of the emissions of emit, written into the pool at once
+
+	/// Slots of the live particles from the furthest to the nearest, see sort_by_depth
+	std::vector<int> draw_order;
+	std::vector<int> sort_scratch;
+	std::vector<uint16_t> depth_keys, depth_keys_scratch;
+
+	/// <summary>
+	/// Optional simulation on the GPU, one transform feedback system per particle type, for very large numbers of particles.
+	/// tick then only accumulates the elapsed time, and draw integrates and draws the particles. Spawned particles are uploaded
+	/// by draw, and handles are not available: register_particle returns an invalid one. Particles are not depth sorted in this mode.
+	/// Not available with Emscripten, where gpu_simulation stays false.
+	/// </summary>
+	bool gpu_simulation = false;
+	int gpu_capacity = 65536; // Per particle type
+#ifndef __EMSCRIPTEN__
+	std::vector<gpu_particle_system> gpu_systems;
+	cgp::opengl_shader_structure feedback_shader;
+#endif
+	float gpu_elapsed_time = 0;
+
+	/// Per type integration coefficients, see update_type_coefficients
+	std::vector<float> acceleration_x, acceleration_y, acceleration_z;
+	std::vector<float> damping_x, damping_y, damping_z;
+	std::vector<float> rot_damping;
+
 	void initialize(float& t, std::string& project_path);
 
-	void tick(float& dt);
+	void tick(float& t);
+
+	/// Adds an emitter, whose first emission is drawn from the current time
+	/// <returns>Index of the emitter in emitters</returns>
+	int add_emitter(particle_emitter const& emitter);
+
+	/// Registers the particles of every emission due at time t
+	void emit(float t, cgp::vec3 const& camera_position);
+
+	/// Registers a copy of the particle. When the pool is full, the drop policy applies and the handle may be invalid.
+	particle_handle register_particle(particle const& particle, int model_id);
+
+	/// Registers copies of the particles of source, without handles. The ones fitting in the pool are appended at once,
+	/// the drop policy applies to the others.
+	void register_particles(particle_storage const& source);
+
+	/// Takes an unused id for a new particle
+	int allocate_id();
+
+	void remove_particle(particle_handle handle);
+
+	bool is_alive(particle_handle handle) const;
+
+	/// Slot of the particle in active_particles, -1 if it died
+	int get_slot(particle_handle handle) const;
+
+	/// Changes the maximum number of live particles, killing the last ones if needed
+	void set_capacity(int capacity_);
+
+	void remove_slot(int slot);
+
+	/// Must be called after particle_types is modified
+	void update_type_coefficients();
+
+	/// Number of live particles, on the CPU or on the GPU
+	int live_particles() const;
+
+	/// Switches between the CPU and the GPU simulation. Particles alive in the previous mode are removed, and the GPU buffers only exist in the GPU mode.
+	void set_gpu_simulation(bool enabled);
+
+	/// Sorts the live particles from the furthest to the nearest along the view axis into draw_order
+	void sort_by_depth(cgp::mat4 const& camera_view);
+
+	/// Fills the per-instance buffers of every type with the live particles, in draw_order
+	void update_instances();
 
-	void register_particle(particle& particle, int model_id);
+	/// Draws every type with one instanced draw call, back to front, the quads facing the given orientation
+	void draw(environment_structure const& environment, cgp::rotation_transform const& orientation);
 };
 
+/// Integrates the particles [begin, end) of p during dt with the coefficients of their type, like particle_manager::tick does,
+/// always using the scalar code path. The survivors are not compacted.
+void integrate_particles_scalar(particle_storage& p, particle_manager const& manager, int begin, int end, float dt);
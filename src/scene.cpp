@@ -17,6 +17,8 @@ void scene_structure::initialize()
 	std::random_device random_device;
 	rand_gen = std::mt19937(random_device());
 	rand_double = std::uniform_real_distribution<>(0.0f, 1.0f);
+	fish_bubbles_random = counter_rng(1);
+	alga_bubbles_random = counter_rng(2);
 
 	// Set the behavior of the camera and its initial position
 	// ********************************************** //
@@ -49,8 +51,12 @@ void scene_structure::initialize()
 		project::path + "shaders/terrain/frag.glsl");
 
 	field_function.ground_level = environment.ground_level;
+	workers.initialize();
+	implicit_surface.workers = &workers;
 	implicit_surface.ground_level = environment.ground_level;
 	implicit_surface.shader = environment.shader;
+	implicit_surface.build_mesh = false; // The field is kept for the fish, the seabed is drawn by terrain_chunks
+	// Computed on the workers: the fish avoid no obstacle until it is ready
 	implicit_surface.set_domain(environment.domain.resolution, environment.domain.length);
 	implicit_surface.update_field(field_function, environment.isovalue);
 	implicit_surface.drawable_param.shape.texture.load_and_initialize_texture_2d_on_gpu(
@@ -83,6 +89,12 @@ void scene_structure::initialize()
 	implicit_surface.drawable_param.shape.material.phong.diffuse = .8f;
 	implicit_surface.drawable_param.shape.material.phong.specular = .03f;
 	implicit_surface.drawable_param.shape.material.phong.specular_exponent = 2;
+	terrain_chunks.appearance = implicit_surface.drawable_param.shape;
+	terrain_chunks.appearance.shader = environment.shader;
+	terrain_chunks.workers = &workers;
+	terrain_chunks.ground_level = environment.ground_level;
+	terrain_chunks.height = environment.domain.length.z;
+	terrain_chunks.reset(field_function, environment.domain.resolution, environment.isovalue);
 	//drawable_chunk = terrain_gen.generate_chunk_data(0, 0, shader_custom);
 
 	// Load particles
@@ -101,13 +113,14 @@ void scene_structure::initialize()
 
 	// Spawn fish groups
 	// ***************************************** //
+	fish_manager.workers = &workers;
+	particles.workers = &workers;
 	fish_manager.initialize(environment.domain.length, environment.ground_level, project::path);
 
 	for (int i = 0; i < fish_manager.fish_groups_number; i++) {
 
 		// Group properties
 		int const fish_type = std::rand() % 5;
-		cgp::mesh_drawable const fish_model = fish_manager.fish_models.at(fish_type);
 		vec3 const group_dir = 2 * vec3(rand_double(rand_gen) - .5f, rand_double(rand_gen) - .5f, rand_double(rand_gen) - .5f);
 		vec3 group_pos;
 		do {
@@ -116,14 +129,9 @@ void scene_structure::initialize()
 
 		// Spawn fishes of group
 		for (int j = 0; j < fish_manager.fishes_per_group; j++) {
-			fish fish;
-			fish.speed = fish_manager.fish_speed;
-			fish.frequency = 12.0f + 6.0f * rand_double(rand_gen);
-			fish.position = group_pos + 50.0f * vec3(rand_double(rand_gen) - .5f, rand_double(rand_gen) - .5f, rand_double(rand_gen) - .5f);
-			fish.direction = group_dir;
-			fish.modelId = fish_type;
-			fish.model = fish_model;
-			fish_manager.fishes.push_back(fish);
+			float const frequency = 12.0f + 6.0f * rand_double(rand_gen);
+			vec3 const position = group_pos + 50.0f * vec3(rand_double(rand_gen) - .5f, rand_double(rand_gen) - .5f, rand_double(rand_gen) - .5f);
+			fish_manager.fishes.add(position, group_dir, fish_manager.fish_speed, frequency, fish_type, i);
 		}
 	}
 
@@ -154,10 +162,57 @@ void scene_structure::initialize()
 		terrain.alga_groups.push_back(group);
 	}
 
+	initialize_bubble_emitters();
+
 	// Remove warnings for unset uniforms
 	cgp_warning::max_warning = 0;
 }
 
+/// <summary>
+/// Every fish releases about 2 bubbles per second behind it, every alga about 1 dot per second around it, when closer than 200 to the camera.
+/// Random numbers are drawn from the entity and the particle sequence number: 16 counters per particle.
+/// </summary>
+void scene_structure::initialize_bubble_emitters()
+{
+	for (int i = 0; i < fish_manager.fishes.size(); i++) {
+		particle_emitter emitter(i, 0, 2.0f, 1, 200.0f);
+		emitter.locate = [this](int fish) { return fish_manager.get_render_position(fish); };
+		emitter.spawn = [this](int fish, vec3 const& position, uint32_t sequence) {
+			counter_rng const& random = fish_bubbles_random;
+			unsigned int const counter = 16 * sequence;
+			vec3 const direction = fish_manager.get_render_direction(fish);
+
+			vec3 random_dir = 10.0f * normalize(-direction + .3f * random.vector(fish, counter + 1));
+			vec3 initial_pos = position - direction * 10.0f;
+			float initial_angle = random.offset(fish, counter + 4) * std::_Pi;
+			float rot_speed = 10.0f * (1.0f + .2f * random.offset(fish, counter + 5)) * (random.uniform(fish, counter + 6) < .5f ? 1.0f : -1.0f);
+			float scale = 1.0f + .3f * random.offset(fish, counter + 7);
+			float lifetime = 3.0f * (1.0f + .5f * random.offset(fish, counter + 8));
+			return particle(initial_pos, random_dir, initial_angle, rot_speed, lifetime, scale);
+		};
+		particles.add_emitter(emitter);
+	}
+
+	int alga_index = 0;
+	for (alga_group const& group : terrain.alga_groups) {
+		for (alga const& alga : group.algas) {
+			vec3 const alga_position = alga.position;
+			particle_emitter emitter(alga_index++, 1, 1.0f, 1, 200.0f);
+			emitter.locate = [alga_position](int) { return alga_position; };
+			emitter.spawn = [this](int a, vec3 const& position, uint32_t sequence) {
+				counter_rng const& random = alga_bubbles_random;
+				unsigned int const counter = 16 * sequence;
+
+				vec3 initial_pos = position + 30.0f * random.vector(a, counter + 1);
+				float scale = 1.0f + .3f * random.offset(a, counter + 4);
+				float lifetime = 5.0f * (1.0f + .5f * random.offset(a, counter + 5));
+				return particle(initial_pos, lifetime, scale);
+			};
+			particles.add_emitter(emitter);
+		}
+	}
+}
+
 vec3 scene_structure::random_vector() {
 	return vec3(random_offset(), random_offset(), random_offset());
 }
@@ -177,6 +232,16 @@ void scene_structure::display_frame() {
 	// Initialisation
 	multipass_rendering.update_screen_size(window.width, window.height);
 
+	// Update time and simulations once per frame, whatever the number of passes calling display_scene()
+	// The particles are updated on the workers while the fish simulation runs
+	float const dt = timer.update();
+	thread_pool::job const particle_update = workers.submit(1, [this](int) { particles.tick(timer.t); });
+	implicit_surface.collect_field();
+	if (fish_manager.fish_groups_number > 0)
+		fish_manager.update(implicit_surface.field_param, environment.get_camera_position(), dt);
+	workers.wait(particle_update);
+	terrain_chunks.update(environment.get_camera_position());
+
 	// ************************************** //
 	// First rendering pass
 	// ************************************* //
@@ -222,55 +287,30 @@ void scene_structure::display_scene() {
 	draw(skybox, environment);
 	glDepthMask(GL_TRUE);  // re-activate depth-buffer write
 
-	// Physical model for fishes
+	// Draw fishes, interpolated between the two last simulation ticks
 	// ***************************************** //
-	if (fish_manager.fish_groups_number > 0)
-		fish_manager.refresh(field_function, timer.t);
+	fish_manager.draw(environment);
 
-	// Draw fishes
+	// Bubbles of the fishes and algas close to the camera
 	// ***************************************** //
-	for (int i = 0;i < fish_manager.fishes.size();i++) {
-		fish fish = fish_manager.fishes[i];
-		
-		rotation_transform horiz_transformation = cgp::rotation_transform::from_axis_angle({ 0,0,1 }, 3.14159f / 2.0f);
-		rotation_transform X_transformation = cgp::rotation_transform::from_axis_angle({ 1,0,0 }, 3.14159f / 2.0f);
-		double r = norm(fish.direction);
-		double theta = acos(fish.direction.z / r);
-		double psi = atan(fish.direction.y / fish.direction.x);
-		if (fish.direction.x < 0)
-			psi += 3.14159f;
-		
-		rotation_transform Y_transformation = cgp::rotation_transform::from_axis_angle({ 0,1,0 }, theta- 3.14159f / 2.0f );
-		rotation_transform Z_transformation = cgp::rotation_transform::from_axis_angle({ 0,0,1 }, psi);
-		fish.model.model.rotation = Z_transformation * Y_transformation * horiz_transformation * X_transformation;
-		fish.model.model.translation = fish.position;
-		//boid.material.color = boid_color[i];
-		environment.uniform_generic.uniform_vec3["head_position"] = fish.position;
-		environment.uniform_generic.uniform_vec3["direction"] = fish.direction;
-		environment.uniform_generic.uniform_float["frequency"] = fish.frequency;
-		draw(fish.model, environment);
-
-		// Register particles if needed
-		if (std::rand() % 30 == 0) {
-			if (norm(fish.position - camera_position) > 200.0f) continue;
-
-			vec3 random_dir = 10.0f * normalize(-fish.direction + .3f * random_vector());
-			vec3 initial_pos = fish.position - fish.direction * 10.0f;
-			float initial_angle = random_offset() * std::_Pi;
-			float rot_speed = 10.0f * (1.0f + .2f * random_offset()) * (rand() % 2 == 0 ? 1.0f : -1.0f);
-			float scale = 1.0f + .3f * random_offset();
-			float lifetime = 3.0f * (1.0f + .5f * random_offset());
-
-			particles.register_particle(particle(initial_pos, random_dir, initial_angle, rot_speed, -1.0f, 1.0f, .1f * vec3(2.0f, 2.0f, 1.0f), .1f, lifetime, scale), 0);
-		}
-	}
-	
+	particles.emit(timer.t, camera_position);
+
 	// Draw algas
 	// ***************************************** //
-	for (alga_group group : terrain.alga_groups) {
-		int counter = 0;
-		for (alga alga : group.algas) {
-			float flow_angle = 2 * std::_Pi * cgp::noise_perlin({ 0.01f * timer.t, 0.01f * ++counter });
+	for (alga_group const& group : terrain.alga_groups) {
+
+		// Flow direction of every alga of the group, in one batched noise evaluation
+		int const alga_number = group.algas.size();
+		alga_flow_x.assign(alga_number, 0.01f * timer.t);
+		alga_flow_y.resize(alga_number);
+		alga_flow_noise.resize(alga_number);
+		for (int k = 0; k < alga_number; k++)
+			alga_flow_y[k] = 0.01f * (k + 1);
+		cgp::noise_perlin_batch(alga_flow_x.data(), alga_flow_y.data(), alga_number, alga_flow_noise.data());
+
+		for (int k = 0; k < alga_number; k++) {
+			alga const& alga = group.algas[k];
+			float flow_angle = 2 * std::_Pi * alga_flow_noise[k];
 			environment.uniform_generic.uniform_vec2["flow_dir"] = { cos(flow_angle), sin(flow_angle) };
 			vec3 const vertical_offset = vec3{ 0.0f, 0.0f, 35.0f };
 			terrain.alga_model.model.translation = alga.position + vertical_offset * alga.scale;
@@ -279,30 +319,14 @@ void scene_structure::display_scene() {
 			environment.uniform_generic.uniform_float["frequency"] = alga.frequency;
 			environment.uniform_generic.uniform_float["rotation"] = alga.rotation;
 			draw(terrain.alga_model, environment);
-
-
-			if (std::rand() % 60 == 0) {
-				if (norm(alga.position - camera_position) > 200.0f) continue;
-
-				vec3 initial_pos = alga.position + 30.0f * random_vector();
-				float scale = 1.0f + .3f * random_offset();
-				float lifetime = 5.0f * (1.0f + .5f * random_offset());
-
-				particles.register_particle(particle(initial_pos, vec3(0, 0, 0), -1.0f, 1.0f * vec3(0, 0, 1), lifetime, scale), 1);
-			}
 		}
 	}
 
-	// Update time
+	// Update sun
 	// ***************************************** //
-	timer.update();
 	if (environment.move_sun)
 		environment.light_direction.y += .1f;
 
-	// Update and draw particles
-	// ***************************************** //
-	particles.tick(timer.t);
-
 	// Move player
 	// ***************************************** //
 	camera_movement.update(camera_control);
@@ -330,7 +354,9 @@ void scene_structure::display_scene() {
 	// Draw terrain
 	// ***************************************** //
 	//draw(implicit_surface.drawable_param.domain_box, environment);
-	draw(implicit_surface.drawable_param.shape, environment);
+	if (implicit_surface.build_mesh)
+		draw(implicit_surface.drawable_param.shape, environment);
+	terrain_chunks.draw(environment);
 
 	display_semi_transparent(camera_position);
 }
@@ -357,19 +383,7 @@ void scene_structure::display_semi_transparent(vec3 const& camera_position)
 	// Re-orient the grass shape to always face the camera direction
 	// Rotation such that the grass follows the right-vector of the camera, while pointing toward the z-direction
 	rotation_transform orient_to_face_camera = rotation_transform::from_frame_transform({ 1,0,0 }, { 0,0,1 }, camera_control.camera_model.right(), { 0,0,1 });
-	for (particle& particle : particles.active_particles) {
-		mesh_drawable* const drawable = &particle.type->drawable;
-		drawable->model.translation = particle.position;
-		drawable->model.rotation = orient_to_face_camera;
-		drawable->model.scaling = particle.type->scale * particle.scale;
-
-		// Particle fades out during last X seconds
-		float const fadeout_time = 1.0f;
-		float const opacity_multiplier = std::min(particle.lifetime - particle.time_lived, fadeout_time) / fadeout_time;
-		environment.uniform_generic.uniform_float["opacity_multiplier"] = opacity_multiplier;
-
-		draw(*drawable, environment);
-	}
+	particles.draw(environment, orient_to_face_camera);
 
 	// Final step
 	// ***************************************** //
@@ -383,7 +397,14 @@ void scene_structure::display_gui()
 {
 
 	// Handle the gui values and the updates using the helper methods (*)
-	implicit_surface.gui_update(environment, field_function);
+	if (implicit_surface.gui_update(environment, field_function))
+		terrain_chunks.reset(field_function, environment.domain.resolution, environment.isovalue);
+
+	if (ImGui::CollapsingHeader("Terrain Streaming")) {
+		ImGui::SliderFloat("View Distance", &terrain_chunks.view_distance, terrain_chunks.chunk_length, 4000.0f);
+		ImGui::SliderInt("Max Chunks", &terrain_chunks.max_chunks, 16, 512);
+		ImGui::Text("Chunks: %d drawn, %d pending", terrain_chunks.uploaded_chunks(), terrain_chunks.pending_chunks());
+	}
 
 	if (ImGui::CollapsingHeader("Environment")) {
 		ImGui::ColorEdit3("Light Color", &environment.light_color[0]);
@@ -406,6 +427,29 @@ void scene_structure::display_gui()
 		ImGui::SliderFloat("Color Attenuation Scale", &environment.scale, 0.001f, 0.1f);
 	}
 
+	if (ImGui::CollapsingHeader("Fishes")) {
+		ImGui::SliderFloat("Simulation Rate", &fish_manager.simulation_rate, 10.0f, 120.0f);
+		ImGui::SliderInt("Max Substeps", &fish_manager.max_substeps, 1, 10);
+		ImGui::SliderFloat("LOD 1 Distance", &fish_manager.lod_distances[0], 50.0f, fish_manager.lod_distances[1]);
+		ImGui::SliderFloat("LOD 2 Distance", &fish_manager.lod_distances[1], fish_manager.lod_distances[0], 2000.0f);
+		ImGui::SliderFloat("School Aggregation Distance", &fish_manager.school_lod_distance, 100.0f, 3000.0f);
+	}
+
+	if (ImGui::CollapsingHeader("Particles")) {
+		ImGui::Text("Live Particles: %d (%d dropped)", particles.live_particles(), particles.dropped_particles);
+		int capacity = particles.capacity;
+		if (ImGui::SliderInt("Capacity", &capacity, 0, 262144))
+			particles.set_capacity(capacity);
+#ifndef __EMSCRIPTEN__
+		bool gpu_simulation = particles.gpu_simulation;
+		if (ImGui::Checkbox("GPU Simulation (Transform Feedback)", &gpu_simulation))
+			particles.set_gpu_simulation(gpu_simulation);
+#endif
+		bool replace = particles.drop_policy == replace_dying_particle;
+		if (ImGui::Checkbox("Replace Dying Particles When Full", &replace))
+			particles.drop_policy = replace ? replace_dying_particle : drop_new_particle;
+	}
+
 	if (ImGui::CollapsingHeader("Other")) {
 		ImGui::Checkbox("Cinematic Camera", &camera_movement.cinematic_mode);
 		ImGui::Checkbox("Stylish Borders", &environment.style_borders);
@@ -8,7 +8,10 @@
 #include "particles.hpp"
 #include "camera_movement.hpp"
 #include "implicit_surface/implicit_surface.hpp"
+#include "implicit_surface/chunked_terrain.hpp"
 #include "multipass/multipass_structure.hpp"
+#include "thread_pool.hpp"
+#include "counter_rng.hpp"
 #include <random>
 
 // This definitions allow to use the structures: mesh, mesh_drawable, etc. without mentionning explicitly cgp::
@@ -34,10 +37,13 @@ struct scene_structure : cgp::scene_inputs_generic {
 	environment_structure environment;   // Standard environment controler
 	input_devices inputs;                // Storage for inputs status (mouse, keyboard, window dimension)
 	timer_basic timer;                   // For timer
+	thread_pool workers;                 // Worker threads shared by the simulations
 
 	// Random
 	std::mt19937 rand_gen;
 	std::uniform_real_distribution<> rand_double;
+	counter_rng fish_bubbles_random;   // Keyed by fish index and particle sequence number
+	counter_rng alga_bubbles_random;   // Keyed by alga index and particle sequence number
 
 	// ****************************** //
 	// Elements and shapes of the scene
@@ -51,12 +57,14 @@ struct scene_structure : cgp::scene_inputs_generic {
 
 	// Terrain
 	implicit_surface_structure implicit_surface; // Structures used for the implicit surface (*)
+	chunked_terrain_structure terrain_chunks;    // Seabed drawn around the camera, generated on the workers
 	field_function_structure field_function;     // A Parametric function used to generate the discrete field (*)
 	water_surface_structure water_surface;        // Mesh for water surface
 
 	// Fishes
 	fish_manager fish_manager;
 	terrain_structure terrain;
+	std::vector<float> alga_flow_x, alga_flow_y, alga_flow_noise; // Inputs and result of the noise giving the flow around the algas
 
 	// Particles
 	particle_manager particles;
@@ -66,6 +74,7 @@ struct scene_structure : cgp::scene_inputs_generic {
 	// ****************************** //
 
 	void initialize(); // Standard initialization to be called before the animation loop
+	void initialize_bubble_emitters();
 	void display_frame();
 	void display_scene();
 	// The frame display to be called within the animation loop
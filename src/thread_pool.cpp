@@ -0,0 +1,135 @@
+#include "thread_pool.hpp"
+
+#include <algorithm>
+
+thread_pool::thread_pool()
+{
+	stopping = false;
+}
+
+thread_pool::~thread_pool()
+{
+	stop();
+}
+
+void thread_pool::initialize(int worker_count)
+{
+	stop();
+
+	if (worker_count < 0)
+		worker_count = std::max(0, (int)std::thread::hardware_concurrency() - 1);
+#ifdef __EMSCRIPTEN__
+	worker_count = 0; // No threads in the default emscripten build
+#endif
+
+	stopping = false;
+	for (int k = 0; k < worker_count; k++)
+		workers.push_back(std::thread(&thread_pool::worker_loop, this));
+}
+
+void thread_pool::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	work_available.notify_all();
+	for (std::thread& worker : workers)
+		worker.join();
+	workers.clear();
+}
+
+int thread_pool::size() const
+{
+	return workers.size() + 1;
+}
+
+void thread_pool::run(int task_count, std::function<void(int)> const& task)
+{
+	if (task_count <= 0)
+		return;
+
+	// Nothing to share
+	if (workers.empty() || task_count == 1) {
+		for (int k = 0; k < task_count; k++)
+			task(k);
+		return;
+	}
+
+	wait(submit(task_count, task));
+}
+
+thread_pool::job thread_pool::submit(int task_count, std::function<void(int)> const& task)
+{
+	job b = std::make_shared<batch>();
+	b->task = task;
+	b->task_count = std::max(0, task_count);
+	b->next.store(0);
+	b->done.store(0);
+
+	if (workers.empty()) {
+		execute(*b);
+		return b;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		batches.push_back(b);
+	}
+	work_available.notify_all();
+	return b;
+}
+
+void thread_pool::wait(job const& b)
+{
+	// Help with the batch, then wait for the tasks taken by the workers
+	execute(*b);
+
+	std::unique_lock<std::mutex> lock(mutex);
+	batch_done.wait(lock, [&b]() { return b->done.load() == b->task_count; });
+	auto const it = std::find(batches.begin(), batches.end(), b);
+	if (it != batches.end())
+		batches.erase(it);
+}
+
+bool thread_pool::finished(job const& b) const
+{
+	return b->done.load() == b->task_count;
+}
+
+void thread_pool::execute(batch& b)
+{
+	for (;;) {
+		int const k = b.next.fetch_add(1);
+		if (k >= b.task_count)
+			return;
+
+		b.task(k);
+
+		if (b.done.fetch_add(1) + 1 == b.task_count) {
+			std::lock_guard<std::mutex> lock(mutex);
+			batch_done.notify_all();
+		}
+	}
+}
+
+void thread_pool::worker_loop()
+{
+	for (;;) {
+		std::shared_ptr<batch> b;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			work_available.wait(lock, [this]() { return stopping || !batches.empty(); });
+			if (stopping && batches.empty())
+				return;
+			b = batches.front();
+		}
+
+		execute(*b);
+
+		// The batch has no task left to take: remove it so that the next one can start
+		std::lock_guard<std::mutex> lock(mutex);
+		if (!batches.empty() && batches.front() == b)
+			batches.pop_front();
+	}
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/// <summary>
+/// Fixed set of worker threads executing batches of indexed tasks.
+///
+/// The thread calling run() takes part in its own batch, so a pool without workers
+/// simply runs the tasks serially, and a task may itself call run() without deadlocking.
+/// A batch may also be started with submit() and joined later with wait(), the caller doing other work in between.
+/// </summary>
+struct thread_pool
+{
+	struct batch;
+
+	/// Batch started by submit()
+	typedef std::shared_ptr<batch> job;
+
+	thread_pool();
+	~thread_pool();
+
+	/// Starts the workers. A negative count uses one worker per hardware thread besides the caller.
+	void initialize(int worker_count = -1);
+
+	/// Joins all the workers. Called by the destructor.
+	void stop();
+
+	/// Number of threads taking part in run(), caller included.
+	int size() const;
+
+	/// Calls task(k) for every k in [0, task_count) and returns once all of them are done.
+	void run(int task_count, std::function<void(int)> const& task);
+
+	/// Starts calling task(k) for every k in [0, task_count) on the workers and returns immediately.
+	/// Without workers, the tasks are run before returning.
+	job submit(int task_count, std::function<void(int)> const& task);
+
+	/// Takes part in the remaining tasks of the job, then waits for it to be done.
+	void wait(job const& j);
+
+	/// True once every task of the job is done, without waiting.
+	bool finished(job const& j) const;
+
+	struct batch {
+		std::function<void(int)> task;
+		int task_count;
+		std::atomic<int> next;
+		std::atomic<int> done;
+	};
+
+private:
+
+	std::vector<std::thread> workers;
+	std::deque<std::shared_ptr<batch>> batches;
+	std::mutex mutex;
+	std::condition_variable work_available;
+	std::condition_variable batch_done;
+	bool stopping;
+
+	void worker_loop();
+
+	/// Executes tasks of the batch until none is left to take.
+	void execute(batch& b);
+};